@@ -0,0 +1,422 @@
+// Recording without a device: the frame arena, the plain data command lists recorded into it and the state filter.
+// Nothing here calls Vulkan, so tests/command_list_test.cpp checks it on its own.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Linear allocator for the commands of one frame slot. Allocating is bumping an offset, safe from any thread, and
+// everything is released at once by reset(), when the GPU finished the frame. When the frame asked for more than
+// the capacity, allocations fail and the next reset() grows the arena to fit.
+class FrameArena {
+private:
+    std::vector<unsigned char> memory;
+    std::atomic<size_t> used{0};
+
+public:
+    explicit FrameArena(size_t capacity) : memory(capacity) {}
+
+    // aligned to 16 bytes, nullptr when the arena is full
+    void* allocate(size_t size) {
+        size = (size + 15) & ~(size_t) 15;
+        size_t offset = used.fetch_add(size);
+        if (offset + size > memory.size()) {
+            return nullptr;
+        }
+        return memory.data() + offset;
+    }
+
+    // nothing allocated before may be in use anymore
+    void reset() {
+        size_t requested = used.load();
+        if (requested > memory.size()) {
+            memory = std::vector<unsigned char>(std::max(requested, memory.size() * 2));
+        }
+        used = 0;
+    }
+
+    bool overflowed() const {
+        return used.load() > memory.size();
+    }
+
+    size_t bytesUsed() const {
+        return std::min(used.load(), memory.size());
+    }
+
+    size_t capacity() const {
+        return memory.size();
+    }
+};
+
+// buffers commands refer to, resolved into Vulkan buffers when translating. The indirect ones are per frame slot.
+enum class BufferId : uint32_t {
+    Index,
+    Instance,
+    IndirectArgs,
+    IndirectCount
+};
+
+enum class CommandType : uint32_t {
+    BindPipeline,
+    SetViewport,
+    SetScissor,
+    BindIndexBuffer,
+    BindVertexBuffer,
+    Draw,
+    DrawIndexedIndirect,
+    DrawIndexedIndirectCount,
+    Dispatch,
+    Barrier,
+    SetRasterState,
+    SetBlendState
+};
+
+// One recorded command: plain data, no Vulkan handles. Pipelines are indices in the pipelines of the renderer.
+struct Command {
+    struct Viewport { float x, y, width, height; };
+    struct Scissor { int32_t x, y; uint32_t width, height; };
+    struct Draw { uint32_t vertexCount, instanceCount, firstVertex, firstInstance; };
+    struct DrawIndirect { BufferId buffer; BufferId countBuffer; uint32_t maxDrawCount; uint32_t stride; uint64_t offset; uint64_t countOffset; };
+    struct Dispatch { uint32_t x, y, z; };
+    struct Barrier { uint32_t srcStages, dstStages, srcAccess, dstAccess; }; // pipeline stage and access flag bits
+    struct RasterState { uint32_t cullMode, frontFace, topology; }; // extended dynamic state, Vulkan enum values
+    struct BlendState { uint32_t enable, srcColorFactor, dstColorFactor, colorOp, srcAlphaFactor, dstAlphaFactor, alphaOp; };
+
+    CommandType type;
+    union {
+        uint32_t pipeline;
+        BufferId buffer;
+        Viewport viewport;
+        Scissor scissor;
+        Draw draw;
+        DrawIndirect drawIndirect;
+        Dispatch dispatch;
+        Barrier barrier;
+        RasterState rasterState;
+        BlendState blendState;
+    };
+};
+
+// A list of commands recorded into a FrameArena, from any thread and without calling Vulkan, so it doesn't need a
+// command pool of its own. Recording is checked with validate() and turned into Vulkan commands later, see
+// translateCommandList(). The commands go in chunks taken from the arena as the list grows.
+class CommandList {
+private:
+    static const uint32_t commandsPerChunk = 256;
+    struct Chunk {
+        Chunk* next;
+        uint32_t count;
+        Command commands[commandsPerChunk];
+    };
+
+    FrameArena* arena = nullptr;
+    Chunk* first = nullptr;
+    Chunk* last = nullptr;
+    size_t commandCount = 0;
+    bool outOfMemory = false;
+
+    void push(const Command& command) {
+        if (outOfMemory) {
+            return;
+        }
+        if (last == nullptr || last->count == commandsPerChunk) {
+            Chunk* chunk = static_cast<Chunk*>(arena->allocate(sizeof(Chunk)));
+            if (chunk == nullptr) {
+                outOfMemory = true; // the list is useless, record it again after the arena grows
+                return;
+            }
+            chunk->next = nullptr;
+            chunk->count = 0;
+            (last != nullptr ? last->next : first) = chunk;
+            last = chunk;
+        }
+        last->commands[last->count++] = command;
+        commandCount++;
+    }
+
+public:
+    // starts an empty list, the previous commands stay in the arena until it's reset
+    void begin(FrameArena& frameArena) {
+        arena = &frameArena;
+        first = last = nullptr;
+        commandCount = 0;
+        outOfMemory = false;
+    }
+
+    void bindPipeline(uint32_t pipeline) {
+        Command command{};
+        command.type = CommandType::BindPipeline;
+        command.pipeline = pipeline;
+        push(command);
+    }
+
+    void setViewport(float x, float y, float width, float height) {
+        Command command{};
+        command.type = CommandType::SetViewport;
+        command.viewport = {x, y, width, height};
+        push(command);
+    }
+
+    void setScissor(int32_t x, int32_t y, uint32_t width, uint32_t height) {
+        Command command{};
+        command.type = CommandType::SetScissor;
+        command.scissor = {x, y, width, height};
+        push(command);
+    }
+
+    void bindIndexBuffer(BufferId buffer) {
+        Command command{};
+        command.type = CommandType::BindIndexBuffer;
+        command.buffer = buffer;
+        push(command);
+    }
+
+    void bindVertexBuffer(BufferId buffer) {
+        Command command{};
+        command.type = CommandType::BindVertexBuffer;
+        command.buffer = buffer;
+        push(command);
+    }
+
+    void draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex, uint32_t firstInstance) {
+        Command command{};
+        command.type = CommandType::Draw;
+        command.draw = {vertexCount, instanceCount, firstVertex, firstInstance};
+        push(command);
+    }
+
+    void drawIndexedIndirect(BufferId buffer, uint64_t offset, uint32_t drawCount, uint32_t stride) {
+        Command command{};
+        command.type = CommandType::DrawIndexedIndirect;
+        command.drawIndirect = {buffer, buffer, drawCount, stride, offset, 0};
+        push(command);
+    }
+
+    void drawIndexedIndirectCount(BufferId buffer, uint64_t offset, BufferId countBuffer, uint64_t countOffset,
+                                  uint32_t maxDrawCount, uint32_t stride) {
+        Command command{};
+        command.type = CommandType::DrawIndexedIndirectCount;
+        command.drawIndirect = {buffer, countBuffer, maxDrawCount, stride, offset, countOffset};
+        push(command);
+    }
+
+    void dispatch(uint32_t x, uint32_t y, uint32_t z) {
+        Command command{};
+        command.type = CommandType::Dispatch;
+        command.dispatch = {x, y, z};
+        push(command);
+    }
+
+    void barrier(uint32_t srcStages, uint32_t dstStages, uint32_t srcAccess, uint32_t dstAccess) {
+        Command command{};
+        command.type = CommandType::Barrier;
+        command.barrier = {srcStages, dstStages, srcAccess, dstAccess};
+        push(command);
+    }
+
+    void setRasterState(const Command::RasterState& state) {
+        Command command{};
+        command.type = CommandType::SetRasterState;
+        command.rasterState = state;
+        push(command);
+    }
+
+    void setBlendState(const Command::BlendState& state) {
+        Command command{};
+        command.type = CommandType::SetBlendState;
+        command.blendState = state;
+        push(command);
+    }
+
+    template <typename Function>
+    void forEach(Function function) const {
+        for (const Chunk* chunk = first; chunk != nullptr; chunk = chunk->next) {
+            for (uint32_t i = 0; i < chunk->count; i++) {
+                function(chunk->commands[i]);
+            }
+        }
+    }
+
+    size_t size() const {
+        return commandCount;
+    }
+
+    bool overflowed() const {
+        return outOfMemory;
+    }
+
+    // checks the list can be translated as it is: draws need a pipeline, a viewport and a scissor first, indexed
+    // draws an index buffer. Returns what's wrong, or an empty string.
+    std::string validate() const {
+        if (outOfMemory) {
+            return "the frame arena ran out of memory";
+        }
+
+        bool pipelineBound = false, viewportSet = false, scissorSet = false, indexBufferBound = false;
+        std::string error;
+        size_t index = 0;
+        forEach([&](const Command& command) {
+            if (!error.empty()) {
+                return;
+            }
+            switch (command.type) {
+                case CommandType::BindPipeline: pipelineBound = true; break;
+                case CommandType::SetViewport: viewportSet = true; break;
+                case CommandType::SetScissor: scissorSet = true; break;
+                case CommandType::BindIndexBuffer: indexBufferBound = true; break;
+                case CommandType::Draw:
+                case CommandType::DrawIndexedIndirect:
+                case CommandType::DrawIndexedIndirectCount:
+                    if (!pipelineBound || !viewportSet || !scissorSet) {
+                        error = "draw without a pipeline, viewport or scissor";
+                    } else if (command.type != CommandType::Draw && !indexBufferBound) {
+                        error = "indexed draw without an index buffer";
+                    }
+                    break;
+                case CommandType::Dispatch:
+                    if (!pipelineBound) {
+                        error = "dispatch without a pipeline";
+                    }
+                    break;
+                default:
+                    break;
+            }
+            if (!error.empty()) {
+                error = "command " + std::to_string(index) + ": " + error;
+            }
+            index++;
+        });
+        return error;
+    }
+};
+
+// Sits in front of a recorder (see CommandBufferRecorder) and drops state commands that wouldn't change anything:
+// binding the bound pipeline or buffers again, or setting the same viewport or scissor. Draws, dispatches and
+// barriers always go through. One filter per command buffer, since a command buffer starts with no state.
+template <typename Recorder>
+class StateFilter {
+private:
+    Recorder& out;
+    bool enabled;
+    uint32_t pipeline = UINT32_MAX;
+    bool viewportSet = false;
+    float viewport[4] = {};
+    bool scissorSet = false;
+    int32_t scissorOffset[2] = {};
+    uint32_t scissorExtent[2] = {};
+    bool indexBufferBound = false;
+    BufferId indexBuffer = BufferId::Index;
+    bool vertexBufferBound = false;
+    BufferId vertexBuffer = BufferId::Instance;
+    bool rasterStateSet = false;
+    Command::RasterState rasterState = {};
+    bool blendStateSet = false;
+    Command::BlendState blendState = {};
+
+    // true when the command has to be issued
+    bool check(bool redundant) {
+        if (redundant) {
+            filtered++; // counted when not enabled too, to show what the filter would save
+            if (enabled) {
+                return false;
+            }
+        }
+        issued++;
+        return true;
+    }
+
+public:
+    uint64_t issued = 0; // state commands passed to the recorder
+    uint64_t filtered = 0; // redundant state commands, dropped only when enabled
+
+    // when not enabled it forwards everything and only counts
+    StateFilter(Recorder& recorder, bool enabled) : out(recorder), enabled(enabled) {}
+
+    void bindPipeline(uint32_t newPipeline) {
+        if (check(newPipeline == pipeline)) {
+            out.bindPipeline(newPipeline);
+            pipeline = newPipeline;
+        }
+    }
+
+    void setViewport(float x, float y, float width, float height) {
+        if (check(viewportSet && viewport[0] == x && viewport[1] == y && viewport[2] == width && viewport[3] == height)) {
+            out.setViewport(x, y, width, height);
+            viewportSet = true;
+            viewport[0] = x;
+            viewport[1] = y;
+            viewport[2] = width;
+            viewport[3] = height;
+        }
+    }
+
+    void setScissor(int32_t x, int32_t y, uint32_t width, uint32_t height) {
+        if (check(scissorSet && scissorOffset[0] == x && scissorOffset[1] == y && scissorExtent[0] == width && scissorExtent[1] == height)) {
+            out.setScissor(x, y, width, height);
+            scissorSet = true;
+            scissorOffset[0] = x;
+            scissorOffset[1] = y;
+            scissorExtent[0] = width;
+            scissorExtent[1] = height;
+        }
+    }
+
+    void bindIndexBuffer(BufferId buffer) {
+        if (check(indexBufferBound && indexBuffer == buffer)) {
+            out.bindIndexBuffer(buffer);
+            indexBufferBound = true;
+            indexBuffer = buffer;
+        }
+    }
+
+    void bindVertexBuffer(BufferId buffer) {
+        if (check(vertexBufferBound && vertexBuffer == buffer)) {
+            out.bindVertexBuffer(buffer);
+            vertexBufferBound = true;
+            vertexBuffer = buffer;
+        }
+    }
+
+    // our pipelines either all have these states dynamic or none does, so binding a pipeline never resets them
+    void setRasterState(const Command::RasterState& state) {
+        if (check(rasterStateSet && memcmp(&rasterState, &state, sizeof(state)) == 0)) {
+            out.setRasterState(state);
+            rasterStateSet = true;
+            rasterState = state;
+        }
+    }
+
+    void setBlendState(const Command::BlendState& state) {
+        if (check(blendStateSet && memcmp(&blendState, &state, sizeof(state)) == 0)) {
+            out.setBlendState(state);
+            blendStateSet = true;
+            blendState = state;
+        }
+    }
+
+    void draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex, uint32_t firstInstance) {
+        out.draw(vertexCount, instanceCount, firstVertex, firstInstance);
+    }
+
+    void drawIndexedIndirect(BufferId buffer, uint64_t offset, uint32_t drawCount, uint32_t stride) {
+        out.drawIndexedIndirect(buffer, offset, drawCount, stride);
+    }
+
+    void drawIndexedIndirectCount(BufferId buffer, uint64_t offset, BufferId countBuffer, uint64_t countOffset,
+                                  uint32_t maxDrawCount, uint32_t stride) {
+        out.drawIndexedIndirectCount(buffer, offset, countBuffer, countOffset, maxDrawCount, stride);
+    }
+
+    void dispatch(uint32_t x, uint32_t y, uint32_t z) {
+        out.dispatch(x, y, z);
+    }
+
+    void barrier(uint32_t srcStages, uint32_t dstStages, uint32_t srcAccess, uint32_t dstAccess) {
+        out.barrier(srcStages, dstStages, srcAccess, dstAccess); // doesn't change bindings
+    }
+};
@@ -7,9 +7,719 @@
 #include <vector>
 #include <cstring>
 #include <cstdint>
+#include <cstddef>
 #include <set>
 #include <algorithm>
 #include <fstream>
+#include <string>
+#include <cmath>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <random>
+#include <iterator>
+#include <cstdio>
+#include "command_list.h"
+
+// accumulates samples (usually milliseconds) so we can print min/avg/max/stddev when the app quits
+struct RunningStats {
+    uint64_t count = 0;
+    double sum = 0.0;
+    double sumSquares = 0.0;
+    double min = 0.0;
+    double max = 0.0;
+
+    void add(double value) {
+        if (count == 0 || value < min) min = value;
+        if (count == 0 || value > max) max = value;
+        count++;
+        sum += value;
+        sumSquares += value * value;
+    }
+
+    double mean() const {
+        return count > 0 ? sum / (double) count : 0.0;
+    }
+
+    double stddev() const {
+        if (count < 2) return 0.0;
+        double m = mean();
+        return std::sqrt(std::max(0.0, sumSquares / (double) count - m * m));
+    }
+
+    void print(const char* name, const char* unit = "ms") const {
+        std::cout << '\t' << name << ": avg " << mean() << unit << ", min " << min << unit << ", max " << max << unit
+                  << ", stddev " << stddev() << unit << " (" << count << " samples)\n";
+    }
+};
+
+// Keeps the main loop at a target frame rate instead of rendering as fast as the present mode lets us.
+// Time comes from glfwGetTime(), which uses the monotonic clock of the platform (see posix_time.c on linux).
+// Sleeping is cheap but imprecise, so we sleep most of the slack and busy-wait the last spinTime seconds.
+// We also predict how long the frame work takes and wake up that much before the deadline, so input is sampled
+// and the frame is recorded as late as possible, which reduces the latency from input to the screen.
+struct FramePacer {
+    double targetFrameTime = 0.0; // seconds, 0 disables pacing
+    double spinTime = 0.002; // how much of the wait is busy-waited
+    double safetyMargin = 0.0005; // extra time added to the predicted work, a late frame costs more than an early one
+
+    double deadline = 0.0; // when the current frame should be done
+    double wakeTime = 0.0; // when the current frame work was supposed to start
+    double workStart = 0.0;
+    double predictedWork = 0.0; // moving average of the frame work time
+    uint64_t missedDeadlines = 0;
+
+    RunningStats wakeJitter; // ms between the planned and actual start of the frame work
+    RunningStats deadlineError; // ms between the deadline and the actual end of the frame work (positive is late)
+    RunningStats workTime; // ms of CPU work per frame
+    RunningStats sleepTime; // ms actually spent sleeping per frame
+    RunningStats oversleep; // ms the sleep lasted longer than asked, what the busy-wait is there to absorb
+
+    bool enabled() const {
+        return targetFrameTime > 0.0;
+    }
+
+    // forget the schedule, after a pause the old deadlines and work times mean nothing
+    void reset() {
+        deadline = 0.0;
+        workStart = 0.0;
+        predictedWork = 0.0;
+    }
+
+    void waitForNextFrame() {
+        if (!enabled()) {
+            return;
+        }
+
+        double now = glfwGetTime();
+        deadline = deadline == 0.0 ? now + targetFrameTime : deadline + targetFrameTime;
+        if (deadline - predictedWork < now) {
+            // we are behind, skip the missed slots instead of rushing frames to catch up
+            missedDeadlines++;
+            deadline = now + predictedWork;
+        }
+
+        wakeTime = deadline - std::min(predictedWork + safetyMargin, targetFrameTime);
+        double sleepFor = wakeTime - now - spinTime;
+        if (sleepFor > 0.0) {
+            double sleepStart = glfwGetTime();
+            std::this_thread::sleep_for(std::chrono::duration<double>(sleepFor));
+            double slept = glfwGetTime() - sleepStart;
+            sleepTime.add(slept * 1000.0);
+            oversleep.add((slept - sleepFor) * 1000.0);
+        }
+        while (glfwGetTime() < wakeTime) {
+            // spin, the sleep above would overshoot
+        }
+
+        workStart = glfwGetTime();
+        wakeJitter.add((workStart - wakeTime) * 1000.0);
+    }
+
+    void frameDone() {
+        if (!enabled()) {
+            return;
+        }
+
+        double now = glfwGetTime();
+        double work = now - workStart;
+        predictedWork = predictedWork == 0.0 ? work : predictedWork * 0.9 + work * 0.1;
+        workTime.add(work * 1000.0);
+        deadlineError.add((now - deadline) * 1000.0);
+    }
+
+    void print() const {
+        std::cout << "frame pacing at " << 1.0 / targetFrameTime << " fps, " << missedDeadlines << " missed deadline(s)\n";
+        wakeJitter.print("wake up jitter");
+        deadlineError.print("deadline error");
+        workTime.print("frame work");
+        sleepTime.print("sleep");
+        oversleep.print("oversleep");
+    }
+};
+
+// Lock-free ring buffer for exactly one producer thread and one consumer thread.
+// The producer only writes tail, the consumer only writes head, so two atomics are all the synchronization needed.
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+private:
+    T items[Capacity];
+    std::atomic<size_t> head{0}; // next item to pop
+    std::atomic<size_t> tail{0}; // next free slot to push into
+public:
+    // returns false when the queue is full
+    bool push(const T& item) {
+        size_t currentTail = tail.load(std::memory_order_relaxed);
+        if (currentTail - head.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        items[currentTail & (Capacity - 1)] = item;
+        tail.store(currentTail + 1, std::memory_order_release); // publishes the item to the consumer
+        return true;
+    }
+
+    // returns false when the queue is empty
+    bool pop(T& item) {
+        size_t currentHead = head.load(std::memory_order_relaxed);
+        if (currentHead == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[currentHead & (Capacity - 1)];
+        head.store(currentHead + 1, std::memory_order_release); // gives the slot back to the producer
+        return true;
+    }
+};
+
+// window and input events, produced by the glfw callbacks on the main thread and consumed by whoever renders
+struct AppEvent {
+    enum Type {
+        Key,
+        FramebufferResize,
+        Synthetic // generated by --event-storm, only counted
+    };
+    Type type;
+    int key = 0;
+    int action = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// Picks how many swap chain images to ask for. Each extra image costs a full framebuffer of memory and can add a frame
+// of latency, too few images make vkAcquireNextImageKHR block because the presentation engine still holds all of them.
+// The tuner starts from the smallest depth, measures the frame time and how long acquire blocks over a window of
+// frames, and goes one image deeper only while acquire blocks for a good part of the frame. If a deeper swap chain
+// doesn't make frames faster it goes back and settles.
+struct SwapChainDepthTuner {
+    const uint32_t windowFrames = 120; // frames measured per decision
+    const double acquireWaitThreshold = 0.1; // acquire blocking more than this fraction of the frame time is a stall
+    const double minImprovement = 0.05; // a deeper swap chain must make frames at least 5% faster to be kept
+
+    uint32_t depth = 2; // images we ask for
+    bool settled = false;
+
+    struct DepthStats {
+        RunningStats frameTime;
+        RunningStats acquireWait;
+    };
+    std::map<uint32_t, DepthStats> stats; // everything measured, by depth, for the report
+    RunningStats windowFrameTime; // current measurement window
+    RunningStats windowAcquireWait;
+    double previousFrameTime = 0.0; // average frame time with depth - 1, 0 if we didn't come from there
+
+    // starts over, for example because the present mode changed
+    void reset(uint32_t minDepth) {
+        depth = std::max(2u, minDepth);
+        settled = false;
+        windowFrameTime = RunningStats();
+        windowAcquireWait = RunningStats();
+        previousFrameTime = 0.0;
+    }
+
+    // returns true when depth changed and the swap chain should be recreated
+    bool addFrame(double frameTimeMs, double acquireWaitMs, uint32_t maxDepth) {
+        stats[depth].frameTime.add(frameTimeMs);
+        stats[depth].acquireWait.add(acquireWaitMs);
+        if (settled) {
+            return false;
+        }
+
+        windowFrameTime.add(frameTimeMs);
+        windowAcquireWait.add(acquireWaitMs);
+        if (windowFrameTime.count < windowFrames) {
+            return false;
+        }
+
+        double frameTime = windowFrameTime.mean();
+        double acquireWait = windowAcquireWait.mean();
+        windowFrameTime = RunningStats();
+        windowAcquireWait = RunningStats();
+
+        if (previousFrameTime > 0.0 && frameTime > previousFrameTime * (1.0 - minImprovement)) {
+            // the extra image didn't help, go back to the smaller swap chain
+            depth--;
+            settled = true;
+            return true;
+        }
+
+        bool canGoDeeper = maxDepth == 0 || depth < maxDepth;
+        if (acquireWait > frameTime * acquireWaitThreshold && canGoDeeper) {
+            previousFrameTime = frameTime;
+            depth++;
+            return true;
+        }
+
+        settled = true;
+        return false;
+    }
+};
+
+// A fixed set of threads running tasks from a queue. Each task gets the index of the worker running it,
+// so it can use resources owned by that worker (like its command pools) without locking.
+class WorkerPool {
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void(uint32_t)>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable allDone;
+    size_t unfinishedTasks = 0; // queued plus running
+    bool stopping = false;
+
+    void workerLoop(uint32_t workerIndex) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (stopping && tasks.empty()) {
+                return;
+            }
+
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task(workerIndex);
+            lock.lock();
+
+            if (--unfinishedTasks == 0) {
+                allDone.notify_all();
+            }
+        }
+    }
+
+public:
+    void start(uint32_t threadCount) {
+        for (uint32_t i = 0; i < threadCount; i++) {
+            threads.emplace_back(&WorkerPool::workerLoop, this, i);
+        }
+    }
+
+    // a pool still running when destroyed (an exception unwinding past its owner) must not destroy joinable threads
+    ~WorkerPool() {
+        stop();
+    }
+
+    // finishes the queued tasks, then joins the threads
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+        stopping = false;
+    }
+
+    uint32_t size() const {
+        return static_cast<uint32_t>(threads.size());
+    }
+
+    void submit(std::function<void(uint32_t)> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+            unfinishedTasks++;
+        }
+        taskAvailable.notify_one();
+    }
+
+    // blocks until every submitted task finished
+    void waitIdle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        allDone.wait(lock, [this] { return unfinishedTasks == 0; });
+    }
+};
+
+// the pipeline permutations a draw can use, created by createGraphicsPipeline()
+enum class Material : uint32_t {
+    Opaque, // the tutorial pipeline
+    Additive, // blends by adding to what is in the framebuffer
+    DoubleSided, // no back face culling
+    Banded, // the opaque pipeline with the banded lighting shader variant
+    Cutout, // the opaque pipeline with the alpha tested shader variant
+    Count
+};
+
+// FNV-1a, continues from a previous hash so several pieces of data can be hashed together
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// the shader files a pipeline can be built from
+enum class PipelineShader : uint32_t {
+    Vertex,
+    InstancedVertex,
+    Fragment,
+    Count
+};
+
+const char* const pipelineShaderFiles[(size_t) PipelineShader::Count] = {
+    "shaders/vert.spv",
+    "shaders/instanced.spv",
+    "shaders/frag.spv",
+};
+
+// The values of the specialization constants of shaders/shader.frag, in constant_id order. One SPIR-V module, each
+// variant is compiled by the driver as if the values were written in the shader.
+struct ShaderVariant {
+    uint32_t lightingModel; // constant_id 0: 0 the vertex color, 1 the vertex color in bands
+    VkBool32 alphaTest; // constant_id 1: discard the fragments under alphaCutoff
+    float alphaCutoff; // constant_id 2
+    float bands; // constant_id 3: steps per color channel of the banded lighting model
+};
+
+const VkSpecializationMapEntry shaderVariantEntries[] = {
+    {0, offsetof(ShaderVariant, lightingModel), sizeof(uint32_t)},
+    {1, offsetof(ShaderVariant, alphaTest), sizeof(VkBool32)}, // bool constants take a VkBool32
+    {2, offsetof(ShaderVariant, alphaCutoff), sizeof(float)},
+    {3, offsetof(ShaderVariant, bands), sizeof(float)},
+};
+
+// The SPIR-V of every PipelineShader, read once and shared by the descriptions (through the hashes) and the pipelines
+// built from them, so a file rewritten in between can't end up in a pipeline registered under its old content.
+struct PipelineShaderCode {
+    std::vector<char> code[(size_t) PipelineShader::Count];
+    uint64_t hashes[(size_t) PipelineShader::Count];
+};
+
+// Everything a graphics pipeline is built from, hashed and compared byte by byte by the PipelineRegistry.
+// Shaders are identified by a hash of their SPIR-V, the render pass by what makes render passes compatible.
+// Only 32 and 64 bit fields, in an order that leaves no padding, so equal states are equal bytes.
+struct PipelineDesc {
+    uint64_t vertexShaderHash;
+    uint64_t fragmentShaderHash;
+    ShaderVariant fragmentVariant; // so variants of the same module get their own pipeline
+    PipelineShader vertexShader;
+    PipelineShader fragmentShader;
+    VkBool32 instanced; // vertex input: one InstanceData per instance, or no vertex input at all
+    VkPrimitiveTopology topology;
+    VkPolygonMode polygonMode;
+    VkCullModeFlags cullMode;
+    VkFrontFace frontFace;
+    VkSampleCountFlagBits rasterizationSamples;
+    VkBool32 blendEnable;
+    VkBlendFactor srcColorBlendFactor;
+    VkBlendFactor dstColorBlendFactor;
+    VkBlendOp colorBlendOp;
+    VkBlendFactor srcAlphaBlendFactor;
+    VkBlendFactor dstAlphaBlendFactor;
+    VkBlendOp alphaBlendOp;
+    VkColorComponentFlags colorWriteMask;
+    VkFormat colorFormat;
+    uint32_t subpass;
+    VkBool32 dynamicRasterState; // cull mode, front face and topology are set in the command buffer
+    VkBool32 dynamicBlendState; // blend enable and equation are set in the command buffer
+};
+static_assert(sizeof(PipelineDesc) == 2 * sizeof(uint64_t) + sizeof(ShaderVariant) + 20 * sizeof(uint32_t),
+    "PipelineDesc must not have padding");
+
+// Pipelines by content. Requesting a state that was already built returns the same VkPipeline instead of compiling
+// it again, so logically identical states cost one pipeline. Every acquire must be matched by a release, the last
+// release destroys the pipeline. Thread safe, the pipeline workers use it while the renderer releases.
+class PipelineRegistry {
+private:
+    struct Entry {
+        PipelineDesc desc;
+        VkPipeline pipeline;
+        uint32_t references;
+    };
+    std::map<uint64_t, std::vector<Entry>> entries; // by hash, the vector only has more than one entry on collisions
+    std::mutex mutex;
+
+    Entry* find(uint64_t hash, const PipelineDesc& desc) {
+        auto it = entries.find(hash);
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        for (auto& entry : it->second) {
+            if (memcmp(&entry.desc, &desc, sizeof(desc)) == 0) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    uint64_t requested = 0;
+    uint64_t created = 0; // pipelines actually built, some may be destroyed by now
+    uint64_t raced = 0; // built twice at the same time on two threads, the second one was destroyed
+
+    // returns the pipeline of this state, calling create (without holding the lock) if there's none yet
+    VkPipeline acquire(VkDevice device, const PipelineDesc& desc, const std::function<VkPipeline()>& create) {
+        uint64_t hash = hashBytes(&desc, sizeof(desc));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requested++;
+            if (Entry* entry = find(hash, desc)) {
+                entry->references++;
+                return entry->pipeline;
+            }
+        }
+
+        VkPipeline pipeline = create();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        created++;
+        if (Entry* entry = find(hash, desc)) {
+            // another thread built the same state meanwhile, keep the first one
+            raced++;
+            vkDestroyPipeline(device, pipeline, nullptr);
+            entry->references++;
+            return entry->pipeline;
+        }
+        entries[hash].push_back({desc, pipeline, 1});
+        return pipeline;
+    }
+
+    void release(VkDevice device, VkPipeline pipeline) {
+        if (pipeline == VK_NULL_HANDLE) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            for (size_t i = 0; i < it->second.size(); i++) {
+                Entry& entry = it->second[i];
+                if (entry.pipeline != pipeline) {
+                    continue;
+                }
+                if (--entry.references == 0) {
+                    vkDestroyPipeline(device, pipeline, nullptr);
+                    it->second.erase(it->second.begin() + i);
+                    if (it->second.empty()) {
+                        entries.erase(it);
+                    }
+                }
+                return;
+            }
+        }
+    }
+
+    size_t unique() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = 0;
+        for (const auto& bucket : entries) {
+            count += bucket.second.size();
+        }
+        return count;
+    }
+};
+
+// per instance vertex input of the instanced pipeline, see shaders/instanced.vert
+struct InstanceData {
+    float transform[4]; // xy offset, zw scale
+    float color[3]; // multiplies the vertex colors
+};
+
+// one entry of the draw list: a triangle drawn into one cell of the window
+struct DrawCommand {
+    Material material;
+    uint32_t cell; // which viewport cell, see cellViewport()
+    uint32_t vertexCount;
+    uint32_t instanceCount;
+    uint32_t firstVertex;
+    uint32_t firstInstance;
+};
+
+// A draw packet is what callers push to the DrawQueue: a draw list index, and a 64 bit key saying where it goes
+// in the frame. The key fields go from the most expensive state to change to the cheapest, so drawing in key order
+// changes state as little as possible:
+//   bits 60-63 pass, 52-59 pipeline, 40-51 descriptor set, 24-39 material parameters, 0-23 depth.
+struct DrawPacket {
+    uint64_t key;
+    uint32_t drawIndex;
+};
+
+uint64_t makeSortKey(uint32_t pass, uint32_t pipeline, uint32_t descriptorSet, uint32_t material, uint32_t depth) {
+    return ((uint64_t) (pass & 0xF) << 60)
+           | ((uint64_t) (pipeline & 0xFF) << 52)
+           | ((uint64_t) (descriptorSet & 0xFFF) << 40)
+           | ((uint64_t) (material & 0xFFFF) << 24)
+           | (uint64_t) (depth & 0xFFFFFF);
+}
+
+uint32_t sortKeyPipeline(uint64_t key) {
+    return (uint32_t) (key >> 52) & 0xFF;
+}
+
+// Collects the draw packets of a frame and sorts them by key. It's a radix sort, 8 passes of 8 bits starting
+// from the least significant byte, so it's linear in the packets, and stable.
+class DrawQueue {
+private:
+    std::vector<DrawPacket> packets;
+    std::vector<DrawPacket> scratch;
+
+public:
+    void clear() {
+        packets.clear();
+    }
+
+    void push(uint64_t key, uint32_t drawIndex) {
+        packets.push_back({key, drawIndex});
+    }
+
+    void sort() {
+        // counting every byte of every key at once, it saves going through the packets 7 more times
+        size_t counts[8][256] = {};
+        for (const auto& packet : packets) {
+            for (int byte = 0; byte < 8; byte++) {
+                counts[byte][(packet.key >> (byte * 8)) & 0xFF]++;
+            }
+        }
+
+        scratch.resize(packets.size());
+        for (int byte = 0; byte < 8; byte++) {
+            size_t* byteCounts = counts[byte];
+            if (!packets.empty() && byteCounts[(packets[0].key >> (byte * 8)) & 0xFF] == packets.size()) {
+                continue; // the same in every key, like unused fields, the order wouldn't change
+            }
+
+            size_t offsets[256];
+            size_t offset = 0;
+            for (int value = 0; value < 256; value++) {
+                offsets[value] = offset;
+                offset += byteCounts[value];
+            }
+            for (const auto& packet : packets) {
+                scratch[offsets[(packet.key >> (byte * 8)) & 0xFF]++] = packet;
+            }
+            packets.swap(scratch);
+        }
+    }
+
+    const std::vector<DrawPacket>& sorted() const {
+        return packets;
+    }
+
+    size_t size() const {
+        return packets.size();
+    }
+};
+
+// The state of our tiny world: the triangle orbits around the center of the window.
+struct SimulationState {
+    double angle = 0.0; // radians
+    double angularVelocity = 1.0; // radians per second
+};
+
+// what the renderer needs from the simulation, in fractions of the framebuffer
+struct RenderState {
+    float offsetX = 0.0f;
+    float offsetY = 0.0f;
+};
+
+// what is drawn while a pipeline is compiled in the background
+enum class AsyncPipelines {
+    Off, // every pipeline is created at startup, nothing to wait for
+    Fallback, // draws use the fallback pipeline until theirs is ready
+    Skip, // draws are left out until their pipeline is ready
+};
+
+// how command buffers are recorded
+enum class RecordMode {
+    PreRecorded, // one command buffer per swap chain image, recorded at startup (and again only if the scene moves)
+    Transient, // one transient command pool per frame in flight, reset as a whole and recorded again every frame
+    Cached, // the primary is recorded every frame, but it only executes cached secondaries, one per cell, re-recorded when their draws change
+    CommandList // the draws are recorded into CommandLists without Vulkan, then translated into the command buffer of the frame slot
+};
+
+// how recordDraws() issues the draws of a batch (consecutive draws with the same pipeline and cell)
+enum class DrawPath {
+    Direct, // one vkCmdDraw per draw
+    Indirect, // one vkCmdDrawIndexedIndirect per batch, reading the draw parameters from a buffer (needs multiDrawIndirect)
+    IndirectCount // one vkCmdDrawIndexedIndirectCount per batch, the draw count comes from a buffer too (Vulkan 1.2 or VK_KHR_draw_indirect_count)
+};
+
+const char* drawPathName(DrawPath path) {
+    switch (path) {
+        case DrawPath::Direct: return "direct";
+        case DrawPath::Indirect: return "indirect";
+        case DrawPath::IndirectCount: return "indirect-count";
+    }
+    return "unknown";
+}
+
+// how we pick the present mode, can be switched at runtime with the 1, 2 and 3 keys
+enum class PresentPolicy {
+    LowLatency, // MAILBOX, or IMMEDIATE (may tear) when there's no mailbox. Renders as fast as possible.
+    PowerSave, // FIFO, waits for vertical blank, never renders frames that won't be shown
+    Adaptive, // FIFO_RELAXED, like FIFO but a late frame is shown right away (may tear) instead of waiting another vblank
+    Count
+};
+
+const char* presentPolicyName(PresentPolicy policy) {
+    switch (policy) {
+        case PresentPolicy::LowLatency: return "low-latency";
+        case PresentPolicy::PowerSave: return "power-save";
+        case PresentPolicy::Adaptive: return "adaptive";
+        default: return "unknown";
+    }
+}
+
+const char* presentModeName(VkPresentModeKHR presentMode) {
+    switch (presentMode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+        case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+        case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+        default: return "other";
+    }
+}
+
+// prints the percentiles we care about for latency targets, samples are sorted in place
+void printPercentiles(const char* name, std::vector<double>& samples, const char* unit = "ms") {
+    if (samples.empty()) {
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) { return samples[std::min(samples.size() - 1, (size_t) (p * (double) samples.size()))]; };
+    std::cout << '\t' << name << ": p50 " << percentile(0.5) << unit << ", p95 " << percentile(0.95) << unit
+              << ", p99 " << percentile(0.99) << unit << ", max " << samples.back() << unit << " (" << samples.size() << " samples)\n";
+}
+
+// things we can change from the command line, see HelloTriangleApplication::parseArguments()
+struct AppSettings {
+    int maxFramesInFlight = 2; // how many frames the CPU can prepare while the GPU is still working on previous ones
+    bool useTimelineSemaphore = true; // throttle frames with a timeline semaphore when the device supports it, fences otherwise
+    PresentPolicy presentPolicy = PresentPolicy::LowLatency;
+    double targetFps = 0.0; // pace the main loop to this frame rate, 0 renders as fast as the present mode allows
+    RecordMode recordMode = RecordMode::PreRecorded;
+    uint32_t drawCount = 1; // draws in the scene
+    uint32_t materialCount = 1; // pipeline permutations used by the draws, up to Material::Count
+    DrawPath drawPath = DrawPath::Direct; // falls back to a simpler path when the device can't do it
+    uint32_t instanceCount = 0; // when not zero, stress mode: this many instances are spread over the draws of the instanced pipeline
+    uint32_t cellCount = 1; // the window is split in a grid of this many cells, draws are spread over them
+    uint32_t recordThreads = 0; // when not zero, the draw list is split between this many threads recording secondary command buffers
+    uint32_t recordingBenchmarkIterations = 0; // when not zero, only measure recording with 1 to N threads and quit
+    uint32_t sortBenchmarkPackets = 0; // when not zero, only measure sorting this many draw packets and quit
+    double simulationHz = 0.0; // fixed simulation rate, 0 disables the simulation (static triangle, recorded once)
+    bool renderThread = false; // render on a separate thread, the main thread only handles glfw events
+    bool submitThread = false; // hand finished frames to a thread that does vkQueueSubmit and vkQueuePresentKHR
+    bool suspendWhenUnfocused = false; // glfw can't tell if the window is covered, losing focus is the closest hint
+    bool stateFilter = true; // drop redundant binds and state changes before they reach Vulkan
+    bool dynamicState = false; // set cull mode, front face, topology and blending in the command buffers, if the device can
+    bool usePresentWait = true; // measure when frames reach the display with VK_KHR_present_wait, if available
+    uint32_t swapChainImages = 0; // 2 double buffering, 3 triple, 4 quad (clamped to what the surface allows), 0 tunes it at runtime
+    uint32_t eventStormSize = 0; // when not zero, the main thread generates bursts of this many fake events to stress event handling
+    uint64_t benchmarkFrames = 0; // when not zero, render this many frames and quit
+    uint64_t pipelineReloadFrames = 0; // when not zero, rebuild the pipelines every this many frames
+    AsyncPipelines asyncPipelines = AsyncPipelines::Off;
+    std::string pipelineCachePath = "pipeline_cache.bin"; // empty disables the on-disk pipeline cache
+    double pipelineCacheSaveSeconds = 30.0; // also save the pipeline cache this often while running, 0 only on exit
+};
 
 class HelloTriangleApplication {
 private:
@@ -21,20 +731,308 @@ private:
     VkQueue graphicsQueue;
     VkSurfaceKHR surface;
     VkQueue presentQueue;
-    VkSwapchainKHR swapChain;
+    VkSwapchainKHR swapChain = VK_NULL_HANDLE;
     std::vector<VkImage> swapChainImages;
     VkFormat swapChainImageFormat;
     VkExtent2D swapChainExtent;
     std::vector<VkImageView> swapChainImageViews;
     VkRenderPass renderPass;
     VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
+    std::vector<VkPipeline> graphicsPipelines; // one per Material, acquired from the registry
+    std::vector<PipelineDesc> materialStates; // per Material, the full state, also what the dynamic states are set to
+    std::shared_ptr<const PipelineShaderCode> pipelineShaders; // what materialStates were described from
+    // extended dynamic state (--dynamic-state), the states the materials differ in are set in the command buffers
+    bool dynamicRasterState = false; // VK_EXT_extended_dynamic_state: cull mode, front face, topology
+    bool dynamicBlendState = false; // VK_EXT_extended_dynamic_state3: blend enable and equation
+    PFN_vkCmdSetCullModeEXT pfnCmdSetCullModeEXT = nullptr;
+    PFN_vkCmdSetFrontFaceEXT pfnCmdSetFrontFaceEXT = nullptr;
+    PFN_vkCmdSetPrimitiveTopologyEXT pfnCmdSetPrimitiveTopologyEXT = nullptr;
+    PFN_vkCmdSetColorBlendEnableEXT pfnCmdSetColorBlendEnableEXT = nullptr;
+    PFN_vkCmdSetColorBlendEquationEXT pfnCmdSetColorBlendEquationEXT = nullptr;
+    PipelineRegistry pipelineRegistry;
     std::vector<VkFramebuffer> swapChainFramebuffers;
     VkCommandPool commandPool;
     std::vector<VkCommandBuffer> commandBuffers; // command buffers will be automatically freed when their command pool is destroyed, so we don't need an explicit cleanup.
-    VkSemaphore imageAvailableSemaphore; // image has been acquired and is ready for rendering,
-    VkSemaphore renderFinishedSemaphore; // rendering has finished and presentation can happen
+    // each frame in flight has its own pair of semaphores, so the CPU can record frame N+1 while the GPU renders frame N.
+    // acquire and present only accept binary semaphores, so these stay even when we have a timeline semaphore.
+    std::vector<VkSemaphore> imageAvailableSemaphores; // image has been acquired and is ready for rendering,
+    std::vector<VkSemaphore> renderFinishedSemaphores; // rendering has finished and presentation can happen
+    size_t currentFrame = 0; // index of the frame slot we are using
+
+    // every queue submission gets a "submission value" from a counter that only goes up. Waiting for a value means
+    // waiting for that submission and everything before it to finish on the GPU. With a timeline semaphore
+    // (Vulkan 1.2 or VK_KHR_timeline_semaphore) the GPU signals the value itself, on older devices we keep
+    // one fence per frame slot and translate values into fences.
+    uint32_t instanceApiVersion = VK_API_VERSION_1_0; // highest version the loader supports, capped to 1.2
+    bool timelineSemaphoreEnabled = false;
+    VkSemaphore frameTimeline = VK_NULL_HANDLE;
+    PFN_vkWaitSemaphores pfnWaitSemaphores = nullptr; // core in 1.2, vkWaitSemaphoresKHR with the extension
+    PFN_vkGetSemaphoreCounterValue pfnGetSemaphoreCounterValue = nullptr;
+    std::vector<VkFence> inFlightFences; // fallback only, signaled when the GPU finished the frame submitted from that slot
+    uint64_t lastSubmittedValue = 0; // value of the latest submission
+    uint64_t lastCompletedValue = 0; // highest value we already know the GPU finished
+    std::vector<uint64_t> frameSlotValues; // submission value of the last frame that used each frame slot, 0 if none
+    std::vector<uint64_t> imagesInFlight; // submission value of the last frame that used each swap chain image, 0 if none
+    std::vector<const char*> enabledDeviceExtensions; // deviceExtensions plus the optional ones the device supports
+
+    // deferred destruction. Anything replaced while running (buffers, images, pipelines, framebuffers, memory...)
+    // may still be used by frames the GPU didn't finish. Instead of stalling everything with vkDeviceWaitIdle, its
+    // destruction is queued with the value of the latest submission and runs once the GPU passed that value.
+    struct DeferredDeletion {
+        uint64_t value; // submission value after which nothing uses it anymore
+        std::function<void()> destroy;
+    };
+    std::deque<DeferredDeletion> deletionQueue; // values only go up, so the oldest is always in front
+    uint64_t deferredDeletionCount = 0;
+    size_t deletionQueuePeak = 0;
+
+    // window resizing. When the swap chain is recreated the old one is handed to the new one through oldSwapchain,
+    // then it goes to the deletion queue together with its image views, framebuffers and command buffers.
+    bool swapChainNeedsRecreate = false; // set by resize callback or when acquire/present report out of date
+    uint64_t swapChainRecreateCount = 0;
+    RunningStats swapChainRecreateStats; // CPU time spent recreating the swap chain
+
+    // present mode policy. Changing the policy recreates the swap chain, each policy keeps its own numbers
+    // so they can be compared in the same run.
+    VkPresentModeKHR swapChainPresentMode;
+    uint32_t swapChainMaxImageCount = 0; // from the surface capabilities, 0 means no limit
+    struct PresentPolicyStats {
+        RunningStats frameTime;
+        RunningStats acquireToPresent; // CPU time from asking for an image to handing it back to the presentation engine
+        std::set<VkPresentModeKHR> presentModesUsed;
+    };
+    PresentPolicyStats presentPolicyStats[(int) PresentPolicy::Count];
+
+    FramePacer framePacer;
+
+    // fixed timestep simulation. The simulation always advances in steps of 1 / simulationHz seconds no matter how fast
+    // we render, and each frame draws the blend of the last two states by how far we are into the next step.
+    SimulationState previousSimulationState;
+    SimulationState currentSimulationState;
+    RenderState renderState; // interpolated state used when recording
+    double simulationAccumulator = 0.0; // time not simulated yet, seconds
+    double lastSimulationTime = 0.0;
+    uint64_t simulationSteps = 0;
+    uint64_t droppedSimulationTime = 0; // times we couldn't keep up and dropped time
+    RunningStats simulationStepStats; // CPU time per step
+    RunningStats frameCpuStats; // CPU time per rendered frame, without the simulation
+    RunningStats recordStats; // CPU time recording the command buffer of a frame (RecordMode::Transient or animated)
+    RunningStats preRecordStats; // CPU time recording all the per image command buffers at once
+    bool pipelineReloadRequested = false; // key R
+
+    // pipeline cache. Kept on disk between runs, so the driver can skip compiling what it already compiled last
+    // time. The blob is only valid for the same device and driver, the file starts with our own header to check that
+    // (the blob's own header has no driver version) and to notice truncated or corrupted files.
+    struct PipelineCacheFileHeader {
+        uint32_t magic;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t dataSize;
+        uint64_t dataHash; // hashBytes of the blob
+    };
+    static const uint32_t pipelineCacheMagic = 0x43504b56; // "VKPC"
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+    bool pipelineCacheWarm = false; // a valid blob was loaded at startup
+    std::string pipelineCacheStatus; // where the blob came from, or why there was none
+    size_t pipelineCacheSavedSize = 0; // size of the blob last loaded or saved
+    double lastPipelineCacheSave = 0.0;
+    uint64_t pipelineCacheSaves = 0;
+    double startupPipelineTime = 0.0; // ms building the pipelines in initVulkan
+
+    // background pipeline compilation (--async-pipelines). Only the fallback pipeline is built at startup, a
+    // material's pipeline is requested the first time a draw uses it and compiled by the pipeline workers.
+    struct CompiledPipeline {
+        Material material;
+        uint64_t generation; // pipelineGeneration when requested
+        VkPipeline pipeline;
+        double compileTime; // ms
+        std::string error; // not empty if the compilation failed
+    };
+    static const Material fallbackMaterial = Material::Opaque;
+    WorkerPool pipelineWorkers;
+    std::vector<VkPipelineCache> pipelineWorkerCaches; // one per worker
+    std::mutex compiledPipelinesMutex;
+    std::vector<CompiledPipeline> compiledPipelines; // finished by the workers, not used yet
+    std::vector<bool> pipelineRequested; // per material, built or being compiled
+    uint64_t pipelineGeneration = 0; // goes up every time the pipelines are (re)built
+    uint32_t pipelinesCompiling = 0;
+    uint64_t pipelineFallbackDraws = 0;
+    uint64_t pipelineSkippedDraws = 0;
+    RunningStats asyncPipelineStats; // compile time of each pipeline built in the background
+    uint64_t lastPipelineReloadFrame = 0;
+    RunningStats pipelineReloadStats; // CPU time rebuilding the pipelines (and pre-recorded command buffers)
+
+    // RecordMode::Transient. Resetting a whole pool is cheaper than resetting buffers one by one, and the
+    // TRANSIENT flag tells the driver the buffers are short lived so it can allocate their memory accordingly.
+    std::vector<VkCommandPool> frameCommandPools;
+    std::vector<VkCommandBuffer> frameCommandBuffers; // one per frame slot, allocated from the pool of that slot
+
+    // the scene is a list of draws. Cell 0 is the one moved by the simulation, the rest never move.
+    std::vector<DrawCommand> drawList;
+
+    // every frame each draw is pushed with its sort key and drawn in key order, see queueDraws()
+    DrawQueue drawQueue;
+    RunningStats drawSortStats; // CPU time filling and sorting the queue
+
+    // parallel recording. Command pools can only be used by one thread at a time, so every worker has its own pool
+    // for every frame slot, and records a secondary command buffer with a slice of the draw list into it.
+    // The primary command buffer then executes them in order.
+    WorkerPool recordWorkers;
+    std::vector<std::vector<VkCommandPool>> recordPools; // [frame slot][worker]
+    // [frame slot][worker][slice], allocated once from the worker's pool. Any worker may record any slice, so each
+    // has a buffer for every slice. Resetting the pool resets them, they are begun again every frame.
+    std::vector<std::vector<std::vector<VkCommandBuffer>>> recordSecondaries;
+
+    // RecordMode::Cached. Every cell (a bucket of the draw list) has a secondary command buffer per frame slot,
+    // remembered with the hash of what it draws. As long as the hash doesn't change the buffer is executed again
+    // as it is. Buffers are per slot because a buffer can't be recorded again while a frame using it is in flight.
+    struct CachedBucket {
+        VkCommandBuffer commandBuffer;
+        uint64_t hash; // 0: never recorded
+    };
+    std::vector<VkCommandPool> bucketCachePools; // one per frame slot, buffers reset one by one
+    std::vector<std::vector<CachedBucket>> bucketCache; // [frame slot][cell]
+
+    // RecordMode::CommandList. The workers record CommandLists into the arena of the frame slot, no command pool
+    // involved, and the render thread translates them all into the primary command buffer.
+    std::vector<std::unique_ptr<FrameArena>> frameArenas; // one per frame slot
+    std::vector<CommandList> commandLists; // one per slice of the draw queue, translated in order
+    RunningStats commandListStats; // CPU time recording the lists, the translation is the rest of recordStats
+    std::vector<std::vector<DrawPacket>> cellPackets; // the sorted packets split by cell
+    uint64_t bucketCacheHits = 0;
+    uint64_t bucketCacheMisses = 0;
+
+    SwapChainDepthTuner depthTuner; // only used when settings.swapChainImages is 0
+
+    // display latency: the time from the start of a frame until it is actually on the screen.
+    // With VK_KHR_present_id every present gets an id, and a background thread uses VK_KHR_present_wait to see when
+    // each id reached the display. vkWaitForPresentKHR needs the swap chain externally synchronized, so the thread only
+    // polls it with a zero timeout while holding swapChainMutex, like every other use of the swap chain.
+    // Without the extensions we estimate: when acquire hands an image back, the frame that used it was already
+    // displayed and then replaced, so the acquire time is an upper bound of its display time.
+    bool presentWaitEnabled = false;
+    PFN_vkWaitForPresentKHR pfnWaitForPresentKHR = nullptr;
+
+    // indirect drawing. The draw parameters are written every frame in host visible buffers, one per frame slot,
+    // in the order they are recorded. A batch of draws is then a single command reading a range of that buffer.
+    // The indexed commands need an index buffer, it only has the 3 indices of our triangle.
+    DrawPath drawPath = DrawPath::Direct; // what the device supports of settings.drawPath
+    PFN_vkCmdDrawIndexedIndirectCount pfnCmdDrawIndexedIndirectCount = nullptr; // core in 1.2, ...KHR with the extension
+    VkBuffer indexBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory indexBufferMemory = VK_NULL_HANDLE;
+    std::vector<VkBuffer> indirectArgBuffers; // VkDrawIndexedIndirectCommand per draw, per frame slot
+    std::vector<VkDeviceMemory> indirectArgMemories;
+    std::vector<VkDrawIndexedIndirectCommand*> indirectArgs; // persistently mapped
+    std::vector<VkBuffer> indirectCountBuffers; // per draw: how many draws of its batch are left, from it. Per frame slot
+    std::vector<VkDeviceMemory> indirectCountMemories;
+    std::vector<uint32_t*> indirectCounts; // persistently mapped
+    bool staticIndirectArgsWritten = false; // RecordMode::PreRecorded writes slot 0 once, see writeIndirectArgs()
+    std::vector<uint32_t> cellFirstArg; // RecordMode::Cached: where the arguments of each cell start
+    // instancing stress mode. Every draw is a range of instances, their transform and color come from this buffer.
+    VkBuffer instanceBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory instanceBufferMemory = VK_NULL_HANDLE;
+
+    // what the StateFilters saw, see addStateCounts(). Sampled after each recorded frame for the per frame numbers.
+    std::atomic<uint64_t> stateCallsIssued{0};
+    std::atomic<uint64_t> stateCallsFiltered{0};
+    uint64_t sampledStateCallsIssued = 0;
+    uint64_t sampledStateCallsFiltered = 0;
+    RunningStats stateIssuedStats; // state commands per recorded frame
+    RunningStats stateFilteredStats;
+
+    std::atomic<uint64_t> recordedDraws{0};
+    std::atomic<uint64_t> recordedDrawCalls{0}; // API calls, a batch is one call in the indirect paths
+
+    struct PendingPresent {
+        VkSwapchainKHR swapChain;
+        uint64_t presentId;
+        double frameStart;
+    };
+    std::mutex presentWaitMutex; // guards everything below, taken after swapChainMutex when both are needed
+    std::condition_variable presentWaitCondition;
+    std::deque<PendingPresent> pendingPresents;
+    std::thread presentWaitThread;
+    bool presentWaitStop = false;
+    uint64_t nextPresentId = 1; // ids must increase for a swap chain, we simply never reuse one
+    std::vector<double> displayLatencies; // ms, one per frame that reached the display
+    std::vector<double> imagePresentFrameStart; // fallback: start of the frame that last presented each image, 0 if none
+    RunningStats acquireWaitStats; // time blocked inside vkAcquireNextImageKHR
+
+    // queue submission. A frame hands its work over as a FrameSubmission: the batches it wants submitted, each one
+    // a VkSubmitInfo, then a present. All of a frame's batches go in one vkQueueSubmit, and with a timeline semaphore
+    // the frames queued together do too. With --submit-thread the frames are queued for a submission thread
+    // and the renderer moves on to the next one. Submission values are still handed out by the renderer when a frame
+    // is queued, so before waiting for a value we wait for the thread to have submitted it.
+    struct SubmitBatch {
+        std::vector<VkCommandBuffer> commandBuffers;
+        std::vector<VkSemaphore> waitSemaphores;
+        std::vector<VkPipelineStageFlags> waitStages;
+        std::vector<VkSemaphore> signalSemaphores; // binary, the present waits on the ones of the last batch
+    };
+    struct FrameSubmission {
+        std::vector<SubmitBatch> batches;
+        uint64_t value; // signaled by the last batch
+        size_t frameSlot; // its fence signals the value without a timeline semaphore
+        VkSwapchainKHR swapChain;
+        uint32_t imageIndex;
+        double frameStart;
+    };
+    std::mutex submitMutex; // guards the queue and the error
+    std::condition_variable submitCondition; // frames were queued, or the thread should stop
+    std::condition_variable submittedCondition; // submittedValue moved
+    std::deque<FrameSubmission> submitQueue;
+    std::thread submitThread;
+    bool submitThreadStop = false;
+    std::string submitThreadError; // what the thread threw, rethrown by the renderer
+    std::atomic<uint64_t> submittedValue{0}; // highest value that was submitted and presented
+    std::atomic<bool> presentOutOfDate{false}; // a present reported out of date or suboptimal
+    // every host access to a swap chain needs it externally synchronized: acquire, present, the present wait
+    // thread, creating the new one (it takes the old one as oldSwapchain) and destroying the old one
+    std::mutex swapChainMutex;
+    RunningStats submitQueueDepthStats; // frames still waiting in the queue when one more is added
+    RunningStats submitCallStats; // CPU time of a vkQueueSubmit
+    RunningStats presentCallStats; // CPU time of a vkQueuePresentKHR
+    RunningStats framesPerSubmitStats;
+
+    // glfw wants events handled on the main thread, and most glfw functions can only be called from it.
+    // the callbacks turn events into AppEvents and the renderer drains them at the start of each frame, which
+    // may be on the same thread or on the render thread (--render-thread) that owns the device queues.
+    // Real events can't be lost: when the queue is full (the renderer is suspended, or busy and the storms filled it)
+    // they go to a list guarded by a mutex instead, so the main thread never waits for the renderer.
+    SpscQueue<AppEvent, 4096> eventQueue;
+    std::atomic<bool> eventOverflowPending{false}; // set while eventOverflow has events, postEvent only locks then
+    std::mutex eventOverflowMutex;
+    std::vector<AppEvent> eventOverflow; // in order, newer than anything in eventQueue
+    uint64_t eventsOverflowed = 0; // main thread
+    std::atomic<int> framebufferWidth{0}; // updated by the main thread, so the render thread doesn't need glfwGetFramebufferSize
+    std::atomic<int> framebufferHeight{0};
+    std::atomic<bool> rendering{false}; // cleared by either thread to stop the render thread
+    std::string renderThreadError; // what the render thread threw, rethrown by the main thread after joining it
+    double lastEventStorm = 0.0;
+    uint64_t syntheticEventsGenerated = 0;
+    uint64_t syntheticEventsProcessed = 0;
+    uint64_t syntheticEventsDropped = 0;
+
+    // nothing to render while the window is minimized or has no area (or optionally, is not focused).
+    // The renderer then blocks instead of acquiring and submitting: the main thread sleeps in glfwWaitEvents,
+    // a render thread sleeps on suspendCondition until a callback says the window is visible again.
+    std::atomic<bool> windowIconified{false};
+    std::atomic<bool> windowFocused{true};
+    std::mutex suspendMutex;
+    std::condition_variable suspendCondition;
+    uint64_t suspendCount = 0;
+    double suspendedTime = 0.0; // seconds
+    uint64_t frameCount = 0;
+
+    // benchmark numbers, printed by printStats()
+    RunningStats frameTimeStats; // time between two drawFrame() calls
+    RunningStats fenceWaitStats; // time the CPU spent blocked waiting the GPU to release a frame slot or image
+    double lastFrameTime = 0.0;
+    double lastFrameDuration = 0.0; // ms, 0 on the first frame
 public:
+    AppSettings settings;
     const uint32_t WIDTH = 800;
     const uint32_t HEIGHT = 600;
 #ifdef NDEBUG
@@ -51,12 +1049,189 @@ public:
 
 public:
     void run() {
+        if (settings.sortBenchmarkPackets > 0) {
+            benchmarkSort(); // CPU only, no window or Vulkan needed
+            return;
+        }
         initWindow();
-        initVulkan();
-        mainLoop();
+        try {
+            initVulkan();
+            if (settings.recordingBenchmarkIterations > 0) {
+                benchmarkRecording();
+            } else {
+                mainLoop();
+                printStats();
+            }
+        } catch (...) {
+            // destroying a std::thread that wasn't joined terminates the process before main() prints the error
+            stopHelperThreads();
+            throw;
+        }
         cleanup();
     }
 
+    // joins the threads started by initVulkan(), on the way out of an error too
+    void stopHelperThreads() {
+        stopSubmitThread();
+        stopPresentWaitThread();
+        stopPipelineWorkers(); // they use the layout and the render pass
+    }
+
+    void parseArguments(int argc, char* argv[]) {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            // every option takes a value right after it
+            if (i + 1 >= argc) {
+                throw std::runtime_error("missing value for argument " + arg);
+            }
+            std::string value = argv[++i];
+
+            if (arg == "--frames-in-flight") {
+                settings.maxFramesInFlight = std::stoi(value);
+                if (settings.maxFramesInFlight < 1) {
+                    throw std::runtime_error("--frames-in-flight must be at least 1!");
+                }
+            } else if (arg == "--sync") {
+                if (value != "timeline" && value != "fences") {
+                    throw std::runtime_error("--sync must be timeline or fences!");
+                }
+                settings.useTimelineSemaphore = value == "timeline";
+            } else if (arg == "--present-policy") {
+                bool found = false;
+                for (int policy = 0; policy < (int) PresentPolicy::Count; policy++) {
+                    if (value == presentPolicyName((PresentPolicy) policy)) {
+                        settings.presentPolicy = (PresentPolicy) policy;
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    throw std::runtime_error("--present-policy must be low-latency, power-save or adaptive!");
+                }
+            } else if (arg == "--target-fps") {
+                settings.targetFps = std::stod(value);
+                if (settings.targetFps < 0.0) {
+                    throw std::runtime_error("--target-fps can't be negative!");
+                }
+            } else if (arg == "--record-mode") {
+                if (value != "prerecorded" && value != "transient" && value != "cached" && value != "commandlist") {
+                    throw std::runtime_error("--record-mode must be prerecorded, transient, cached or commandlist!");
+                }
+                if (value == "transient") {
+                    settings.recordMode = RecordMode::Transient;
+                } else if (value == "cached") {
+                    settings.recordMode = RecordMode::Cached;
+                } else if (value == "commandlist") {
+                    settings.recordMode = RecordMode::CommandList;
+                } else {
+                    settings.recordMode = RecordMode::PreRecorded;
+                }
+            } else if (arg == "--draws") {
+                settings.drawCount = static_cast<uint32_t>(std::stoul(value));
+            } else if (arg == "--materials") {
+                settings.materialCount = static_cast<uint32_t>(std::stoul(value));
+                if (settings.materialCount == 0 || settings.materialCount > (uint32_t) Material::Count) {
+                    throw std::runtime_error("--materials must be between 1 and " + std::to_string((uint32_t) Material::Count) + "!");
+                }
+            } else if (arg == "--draw-path") {
+                if (value == "direct") {
+                    settings.drawPath = DrawPath::Direct;
+                } else if (value == "indirect") {
+                    settings.drawPath = DrawPath::Indirect;
+                } else if (value == "indirect-count") {
+                    settings.drawPath = DrawPath::IndirectCount;
+                } else {
+                    throw std::runtime_error("--draw-path must be direct, indirect or indirect-count!");
+                }
+            } else if (arg == "--instances") {
+                settings.instanceCount = static_cast<uint32_t>(std::stoul(value));
+            } else if (arg == "--sort-benchmark") {
+                settings.sortBenchmarkPackets = static_cast<uint32_t>(std::stoul(value));
+            } else if (arg == "--cells") {
+                settings.cellCount = static_cast<uint32_t>(std::stoul(value));
+            } else if (arg == "--record-threads") {
+                settings.recordThreads = static_cast<uint32_t>(std::stoul(value));
+            } else if (arg == "--recording-benchmark") {
+                settings.recordingBenchmarkIterations = static_cast<uint32_t>(std::stoul(value));
+            } else if (arg == "--sim-hz") {
+                settings.simulationHz = std::stod(value);
+                if (settings.simulationHz < 0.0) {
+                    throw std::runtime_error("--sim-hz can't be negative!");
+                }
+            } else if (arg == "--render-thread") {
+                if (value != "on" && value != "off") {
+                    throw std::runtime_error("--render-thread must be on or off!");
+                }
+                settings.renderThread = value == "on";
+            } else if (arg == "--async-pipelines") {
+                if (value == "off") {
+                    settings.asyncPipelines = AsyncPipelines::Off;
+                } else if (value == "fallback") {
+                    settings.asyncPipelines = AsyncPipelines::Fallback;
+                } else if (value == "skip") {
+                    settings.asyncPipelines = AsyncPipelines::Skip;
+                } else {
+                    throw std::runtime_error("--async-pipelines must be off, fallback or skip!");
+                }
+            } else if (arg == "--pipeline-cache") {
+                settings.pipelineCachePath = value == "off" ? "" : value;
+            } else if (arg == "--pipeline-cache-save") {
+                settings.pipelineCacheSaveSeconds = std::stod(value);
+            } else if (arg == "--reload-pipelines") {
+                settings.pipelineReloadFrames = std::stoull(value);
+            } else if (arg == "--event-storm") {
+                settings.eventStormSize = static_cast<uint32_t>(std::stoul(value));
+            } else if (arg == "--suspend-unfocused") {
+                if (value != "on" && value != "off") {
+                    throw std::runtime_error("--suspend-unfocused must be on or off!");
+                }
+                settings.suspendWhenUnfocused = value == "on";
+            } else if (arg == "--submit-thread") {
+                if (value != "on" && value != "off") {
+                    throw std::runtime_error("--submit-thread must be on or off!");
+                }
+                settings.submitThread = value == "on";
+            } else if (arg == "--dynamic-state") {
+                if (value != "on" && value != "off") {
+                    throw std::runtime_error("--dynamic-state must be on or off!");
+                }
+                settings.dynamicState = value == "on";
+            } else if (arg == "--state-filter") {
+                if (value != "on" && value != "off") {
+                    throw std::runtime_error("--state-filter must be on or off!");
+                }
+                settings.stateFilter = value == "on";
+            } else if (arg == "--present-wait") {
+                if (value != "on" && value != "off") {
+                    throw std::runtime_error("--present-wait must be on or off!");
+                }
+                settings.usePresentWait = value == "on";
+            } else if (arg == "--swapchain-images") {
+                settings.swapChainImages = static_cast<uint32_t>(std::stoul(value));
+                if (settings.swapChainImages == 1 || settings.swapChainImages > 4) {
+                    throw std::runtime_error("--swapchain-images must be 2, 3, 4 or 0 (auto)!");
+                }
+            } else if (arg == "--benchmark") {
+                settings.benchmarkFrames = std::stoull(value);
+            } else {
+                throw std::runtime_error("unknown argument " + arg);
+            }
+        }
+
+        if (settings.drawCount == 0 || settings.cellCount == 0) {
+            throw std::runtime_error("--draws and --cells must be at least 1!");
+        }
+        if (settings.recordingBenchmarkIterations > 0 && settings.recordThreads == 0) {
+            settings.recordThreads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        if (settings.recordMode == RecordMode::Cached && settings.recordThreads > 0) {
+            throw std::runtime_error("--record-mode cached records the few changed cells on the render thread, it can't use --record-threads!");
+        }
+        if ((settings.recordThreads > 0 || settings.recordingBenchmarkIterations > 0) && settings.recordMode == RecordMode::PreRecorded) {
+            // secondary command buffers are recorded per frame slot, so the frame has to be recorded every frame too
+            settings.recordMode = RecordMode::Transient;
+        }
+    }
+
 private:
     static std::vector<char> readFile(const std::string& filename) {
         std::ifstream file(filename, std::ios::ate | std::ios::binary);
@@ -197,6 +1372,123 @@ private:
         return requiredExtensions.empty();
     }
 
+    bool isDeviceExtensionAvailable(VkPhysicalDevice device, const char* extensionName) {
+        uint32_t extensionCount;
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+        std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+
+        for (const auto& extension : availableExtensions) {
+            if (strcmp(extension.extensionName, extensionName) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // timeline semaphores need the feature bit, which is queried through vkGetPhysicalDeviceFeatures2 (Vulkan 1.1).
+    // on a 1.1 device we can still get them from the VK_KHR_timeline_semaphore extension.
+    bool checkTimelineSemaphoreSupport(VkPhysicalDevice device) {
+        if (instanceApiVersion < VK_API_VERSION_1_1) {
+            return false;
+        }
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(device, &properties);
+        if (properties.apiVersion < VK_API_VERSION_1_2 &&
+            !isDeviceExtensionAvailable(device, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME)) {
+            return false;
+        }
+
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+        timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &timelineFeatures;
+        vkGetPhysicalDeviceFeatures2(device, &features2);
+
+        return timelineFeatures.timelineSemaphore == VK_TRUE;
+    }
+
+    bool checkDrawIndirectCountSupport(VkPhysicalDevice device) {
+        if (isDeviceExtensionAvailable(device, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME)) {
+            return true;
+        }
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(device, &properties);
+        if (instanceApiVersion < VK_API_VERSION_1_2 || properties.apiVersion < VK_API_VERSION_1_2) {
+            return false;
+        }
+
+        // optional in 1.2 core
+        VkPhysicalDeviceVulkan12Features vulkan12Features{};
+        vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &vulkan12Features;
+        vkGetPhysicalDeviceFeatures2(device, &features2);
+
+        return vulkan12Features.drawIndirectCount == VK_TRUE;
+    }
+
+    // extended dynamic state is enough for cull mode, front face and topology. Blending needs two features of
+    // extended dynamic state 3. Either one can be missing.
+    void checkExtendedDynamicStateSupport(VkPhysicalDevice device, bool& raster, bool& blend) {
+        raster = blend = false;
+        if (instanceApiVersion < VK_API_VERSION_1_1) {
+            return;
+        }
+
+        VkPhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures{};
+        extendedDynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+        VkPhysicalDeviceExtendedDynamicState3FeaturesEXT extendedDynamicState3Features{};
+        extendedDynamicState3Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT;
+        void* featureChain = nullptr;
+        bool hasExtendedDynamicState = isDeviceExtensionAvailable(device, VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+        bool hasExtendedDynamicState3 = isDeviceExtensionAvailable(device, VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME);
+        if (hasExtendedDynamicState) {
+            extendedDynamicStateFeatures.pNext = featureChain;
+            featureChain = &extendedDynamicStateFeatures;
+        }
+        if (hasExtendedDynamicState3) {
+            extendedDynamicState3Features.pNext = featureChain;
+            featureChain = &extendedDynamicState3Features;
+        }
+        if (featureChain == nullptr) {
+            return;
+        }
+
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = featureChain;
+        vkGetPhysicalDeviceFeatures2(device, &features2);
+
+        raster = hasExtendedDynamicState && extendedDynamicStateFeatures.extendedDynamicState == VK_TRUE;
+        blend = hasExtendedDynamicState3 && extendedDynamicState3Features.extendedDynamicState3ColorBlendEnable == VK_TRUE &&
+                extendedDynamicState3Features.extendedDynamicState3ColorBlendEquation == VK_TRUE;
+    }
+
+    bool checkPresentWaitSupport(VkPhysicalDevice device) {
+        if (instanceApiVersion < VK_API_VERSION_1_1 ||
+            !isDeviceExtensionAvailable(device, VK_KHR_PRESENT_ID_EXTENSION_NAME) ||
+            !isDeviceExtensionAvailable(device, VK_KHR_PRESENT_WAIT_EXTENSION_NAME)) {
+            return false;
+        }
+
+        VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+        presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+        VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+        presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+        presentWaitFeatures.pNext = &presentIdFeatures;
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &presentWaitFeatures;
+        vkGetPhysicalDeviceFeatures2(device, &features2);
+
+        return presentIdFeatures.presentId == VK_TRUE && presentWaitFeatures.presentWait == VK_TRUE;
+    }
+
     // checks if a device is suitable for us in vulkan support
     bool isDeviceSuitable(VkPhysicalDevice device) {
         QueueFamilyIndices indices = findQueueFamilies(device);
@@ -227,16 +1519,30 @@ private:
         return availableFormats[0]; // if no desired format is found we settle for the first
     }
 
-    // presentation mode represents the actual conditions for showing images to the screen
+    // presentation mode represents the actual conditions for showing images to the screen.
+    // each policy has a list of modes in order of preference, FIFO is always last since it's guaranteed to be available.
     VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes) {
-        for (const auto& availablePresentMode : availablePresentModes) {
-            if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) { // Instead of blocking the application when the queue
-                                                                        // is full,/ the images that are already queued are
-                                                                        // simply replaced with the newer ones.
-                return availablePresentMode;
-            }
-        }
-
+        std::vector<VkPresentModeKHR> preferredModes;
+        switch (settings.presentPolicy) {
+            case PresentPolicy::LowLatency:
+                preferredModes = {VK_PRESENT_MODE_MAILBOX_KHR, // Instead of blocking the application when the queue
+                                                               // is full, the images that are already queued are
+                                                               // simply replaced with the newer ones.
+                                  VK_PRESENT_MODE_IMMEDIATE_KHR}; // images go to the screen right away, may tear
+                break;
+            case PresentPolicy::Adaptive:
+                preferredModes = {VK_PRESENT_MODE_FIFO_RELAXED_KHR};
+                break;
+            default:
+                break;
+        }
+
+        for (auto preferredMode : preferredModes) {
+            if (std::find(availablePresentModes.begin(), availablePresentModes.end(), preferredMode) != availablePresentModes.end()) {
+                return preferredMode;
+            }
+        }
+
         return VK_PRESENT_MODE_FIFO_KHR; // guaranteed to be available if other fail
     }
 
@@ -245,7 +1551,9 @@ private:
         if(capabilities.currentExtent.width != UINT32_MAX) {
             return capabilities.currentExtent;
         } else {
-            VkExtent2D actualExtent = {WIDTH, HEIGHT};
+            // the window may have been resized, so use the size in pixels reported by glfw instead of WIDTH and HEIGHT
+            int width = framebufferWidth, height = framebufferHeight;
+            VkExtent2D actualExtent = {static_cast<uint32_t>(width), static_cast<uint32_t>(height)};
 
             actualExtent.width = std::max(
                     capabilities.minImageExtent.width, std::min(capabilities.maxImageExtent.width, actualExtent.width));
@@ -257,6 +1565,19 @@ private:
     }
 
 
+    // A 1.0 loader doesn't have vkEnumerateInstanceVersion, so we look it up instead of calling it directly.
+    // We ask for 1.2 at most, timeline semaphores are core there.
+    uint32_t chooseInstanceApiVersion() {
+        auto enumerateInstanceVersion = (PFN_vkEnumerateInstanceVersion) vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion");
+        uint32_t loaderVersion = VK_API_VERSION_1_0;
+        if (enumerateInstanceVersion != nullptr) {
+            enumerateInstanceVersion(&loaderVersion);
+        }
+
+        instanceApiVersion = std::min(loaderVersion, (uint32_t) VK_API_VERSION_1_2);
+        return instanceApiVersion;
+    }
+
     // methods used to Initialize Vulkan in initVulkan()
     void createInstance() {
         if (enableValidationLayers && !checkValidationLayerSupport()) {
@@ -272,7 +1593,7 @@ private:
         appInfo.applicationVersion = VK_MAKE_VERSION(1,0,0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_VERSION(1,0,0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        appInfo.apiVersion = chooseInstanceApiVersion();
 
         VkInstanceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -426,6 +1747,103 @@ private:
         // specifying device features we will use
         VkPhysicalDeviceFeatures deviceFeatures{};
 
+        // batching several draws in one indirect command needs multiDrawIndirect, and our indirect draws
+        // may have a firstInstance, so drawIndirectFirstInstance too. Otherwise every draw is a vkCmdDraw.
+        drawPath = settings.drawPath;
+        if (drawPath != DrawPath::Direct) {
+            VkPhysicalDeviceFeatures supportedFeatures;
+            vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+            if (supportedFeatures.multiDrawIndirect == VK_TRUE && supportedFeatures.drawIndirectFirstInstance == VK_TRUE) {
+                deviceFeatures.multiDrawIndirect = VK_TRUE;
+                deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+            } else {
+                std::cout << "no multiDrawIndirect, drawing with the direct path\n";
+                drawPath = DrawPath::Direct;
+            }
+        }
+
+        // optional extensions and their feature structs, chained through pNext
+        enabledDeviceExtensions = deviceExtensions;
+        void* featureChain = nullptr;
+
+        // with Vulkan 1.2 the features that became core are enabled through VkPhysicalDeviceVulkan12Features,
+        // which can't be in the chain together with the structs of the extensions it replaced
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        bool vulkan12 = instanceApiVersion >= VK_API_VERSION_1_2 && properties.apiVersion >= VK_API_VERSION_1_2;
+        VkPhysicalDeviceVulkan12Features vulkan12Features{};
+        vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+        timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        timelineSemaphoreEnabled = settings.useTimelineSemaphore && checkTimelineSemaphoreSupport(physicalDevice);
+        if (timelineSemaphoreEnabled) {
+            if (vulkan12) {
+                vulkan12Features.timelineSemaphore = VK_TRUE;
+            } else {
+                enabledDeviceExtensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+                timelineFeatures.timelineSemaphore = VK_TRUE;
+                timelineFeatures.pNext = featureChain;
+                featureChain = &timelineFeatures;
+            }
+        }
+
+        if (drawPath == DrawPath::IndirectCount) {
+            if (!checkDrawIndirectCountSupport(physicalDevice)) {
+                std::cout << "no vkCmdDrawIndexedIndirectCount, drawing with the indirect path\n";
+                drawPath = DrawPath::Indirect;
+            } else if (vulkan12) {
+                vulkan12Features.drawIndirectCount = VK_TRUE;
+            } else {
+                enabledDeviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME); // no feature struct
+            }
+        }
+
+        if (vulkan12 && (vulkan12Features.timelineSemaphore == VK_TRUE || vulkan12Features.drawIndirectCount == VK_TRUE)) {
+            vulkan12Features.pNext = featureChain;
+            featureChain = &vulkan12Features;
+        }
+
+        VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+        presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+        VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+        presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+        presentWaitEnabled = settings.usePresentWait && checkPresentWaitSupport(physicalDevice);
+        if (presentWaitEnabled) {
+            enabledDeviceExtensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+            enabledDeviceExtensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+            presentIdFeatures.presentId = VK_TRUE;
+            presentIdFeatures.pNext = featureChain;
+            presentWaitFeatures.presentWait = VK_TRUE;
+            presentWaitFeatures.pNext = &presentIdFeatures;
+            featureChain = &presentWaitFeatures;
+        }
+
+        VkPhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures{};
+        extendedDynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+        VkPhysicalDeviceExtendedDynamicState3FeaturesEXT extendedDynamicState3Features{};
+        extendedDynamicState3Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT;
+        if (settings.dynamicState) {
+            checkExtendedDynamicStateSupport(physicalDevice, dynamicRasterState, dynamicBlendState);
+            if (!dynamicRasterState) {
+                std::cout << "no VK_EXT_extended_dynamic_state, cull mode, front face and topology stay in the pipelines\n";
+            } else {
+                enabledDeviceExtensions.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+                extendedDynamicStateFeatures.extendedDynamicState = VK_TRUE;
+                extendedDynamicStateFeatures.pNext = featureChain;
+                featureChain = &extendedDynamicStateFeatures;
+            }
+            if (!dynamicBlendState) {
+                std::cout << "no VK_EXT_extended_dynamic_state3 blending, blending stays in the pipelines\n";
+            } else {
+                enabledDeviceExtensions.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME);
+                extendedDynamicState3Features.extendedDynamicState3ColorBlendEnable = VK_TRUE;
+                extendedDynamicState3Features.extendedDynamicState3ColorBlendEquation = VK_TRUE;
+                extendedDynamicState3Features.pNext = featureChain;
+                featureChain = &extendedDynamicState3Features;
+            }
+        }
+
         // Creating the logical device
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -434,9 +1852,10 @@ private:
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
 
         createInfo.pEnabledFeatures = &deviceFeatures;
+        createInfo.pNext = featureChain;
 
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledDeviceExtensions.size());
+        createInfo.ppEnabledExtensionNames = enabledDeviceExtensions.data();
 
         // https://www.khronos.org/registry/vulkan/specs/1.1-extensions/html/vkspec.html#devsandqueues-device-creation
         // enabledLayerCount is deprecated and ignored.
@@ -455,6 +1874,46 @@ private:
 
         vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
         vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+
+        if (timelineSemaphoreEnabled) {
+            pfnWaitSemaphores = (PFN_vkWaitSemaphores) vkGetDeviceProcAddr(device, vulkan12 ? "vkWaitSemaphores" : "vkWaitSemaphoresKHR");
+            pfnGetSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValue) vkGetDeviceProcAddr(device,
+                    vulkan12 ? "vkGetSemaphoreCounterValue" : "vkGetSemaphoreCounterValueKHR");
+            if (pfnWaitSemaphores == nullptr || pfnGetSemaphoreCounterValue == nullptr) {
+                throw std::runtime_error("failed to load timeline semaphore functions!");
+            }
+        }
+
+        if (presentWaitEnabled) {
+            pfnWaitForPresentKHR = (PFN_vkWaitForPresentKHR) vkGetDeviceProcAddr(device, "vkWaitForPresentKHR");
+            if (pfnWaitForPresentKHR == nullptr) {
+                throw std::runtime_error("failed to load vkWaitForPresentKHR!");
+            }
+        }
+
+        if (dynamicRasterState) {
+            pfnCmdSetCullModeEXT = (PFN_vkCmdSetCullModeEXT) vkGetDeviceProcAddr(device, "vkCmdSetCullModeEXT");
+            pfnCmdSetFrontFaceEXT = (PFN_vkCmdSetFrontFaceEXT) vkGetDeviceProcAddr(device, "vkCmdSetFrontFaceEXT");
+            pfnCmdSetPrimitiveTopologyEXT = (PFN_vkCmdSetPrimitiveTopologyEXT) vkGetDeviceProcAddr(device, "vkCmdSetPrimitiveTopologyEXT");
+            if (pfnCmdSetCullModeEXT == nullptr || pfnCmdSetFrontFaceEXT == nullptr || pfnCmdSetPrimitiveTopologyEXT == nullptr) {
+                throw std::runtime_error("failed to load the extended dynamic state functions!");
+            }
+        }
+        if (dynamicBlendState) {
+            pfnCmdSetColorBlendEnableEXT = (PFN_vkCmdSetColorBlendEnableEXT) vkGetDeviceProcAddr(device, "vkCmdSetColorBlendEnableEXT");
+            pfnCmdSetColorBlendEquationEXT = (PFN_vkCmdSetColorBlendEquationEXT) vkGetDeviceProcAddr(device, "vkCmdSetColorBlendEquationEXT");
+            if (pfnCmdSetColorBlendEnableEXT == nullptr || pfnCmdSetColorBlendEquationEXT == nullptr) {
+                throw std::runtime_error("failed to load the extended dynamic state 3 functions!");
+            }
+        }
+
+        if (drawPath == DrawPath::IndirectCount) {
+            pfnCmdDrawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCount) vkGetDeviceProcAddr(device,
+                    vulkan12 ? "vkCmdDrawIndexedIndirectCount" : "vkCmdDrawIndexedIndirectCountKHR");
+            if (pfnCmdDrawIndexedIndirectCount == nullptr) {
+                throw std::runtime_error("failed to load vkCmdDrawIndexedIndirectCount!");
+            }
+        }
     }
 
 
@@ -493,10 +1952,16 @@ private:
         VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
         VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
 
-        uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1; //avoids waiting internal operations for rendering
+        // more images avoid waiting internal operations for rendering, but cost memory and latency
+        uint32_t imageCount = settings.swapChainImages > 0 ? settings.swapChainImages : depthTuner.depth;
+        imageCount = std::max(imageCount, swapChainSupport.capabilities.minImageCount);
         if(swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount) {
             imageCount = swapChainSupport.capabilities.maxImageCount;
         }
+        if (settings.swapChainImages == 0) {
+            depthTuner.depth = imageCount; // so the tuner knows what it really got
+            swapChainMaxImageCount = swapChainSupport.capabilities.maxImageCount;
+        }
 
         VkSwapchainCreateInfoKHR createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -530,9 +1995,15 @@ private:
 
         createInfo.presentMode = presentMode;
         createInfo.clipped = VK_TRUE; // we don't care about the pixels obscured by a window in front of them, better performance
-        createInfo.oldSwapchain = VK_NULL_HANDLE; // this is needed to support window resizing. We will be skipping this for now.
+        createInfo.oldSwapchain = swapChain; // VK_NULL_HANDLE the first time, the swap chain being replaced when resizing.
+                                             // This lets the driver reuse resources and keep presenting while we switch.
 
-        if(vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS) {
+        VkResult result;
+        {
+            std::lock_guard<std::mutex> lock(swapChainMutex);
+            result = vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain);
+        }
+        if (result != VK_SUCCESS) {
             throw std::runtime_error("failed to create swap chain!");
         }
 
@@ -541,6 +2012,8 @@ private:
         vkGetSwapchainImagesKHR(device, swapChain, &imageCount, swapChainImages.data());
         swapChainImageFormat = surfaceFormat.format;
         swapChainExtent = extent;
+        swapChainPresentMode = presentMode;
+        presentPolicyStats[(int) settings.presentPolicy].presentModesUsed.insert(presentMode);
     }
 
     void createImageViews() {
@@ -631,12 +2104,249 @@ private:
         }
     }
 
-    void createGraphicsPipeline() {
-        auto vertShaderCode = readFile("shaders/vert.spv");
-        auto fragShaderCode = readFile("shaders/frag.spv");
+    // returns the blob saved in the pipeline cache file if it was written for this device and driver, empty otherwise
+    std::vector<char> loadPipelineCacheData(const VkPhysicalDeviceProperties& properties) {
+        std::ifstream file(settings.pipelineCachePath, std::ios::ate | std::ios::binary);
+        if (!file.is_open()) {
+            pipelineCacheStatus = "no file yet";
+            return {};
+        }
+
+        size_t fileSize = (size_t) file.tellg();
+        PipelineCacheFileHeader header{};
+        if (fileSize >= sizeof(header)) {
+            file.seekg(0);
+            file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        }
+        if (header.magic != pipelineCacheMagic || header.dataSize != fileSize - sizeof(header)) {
+            pipelineCacheStatus = "file truncated or not a pipeline cache";
+            return {};
+        }
+        if (header.vendorID != properties.vendorID || header.deviceID != properties.deviceID ||
+            header.driverVersion != properties.driverVersion ||
+            memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            pipelineCacheStatus = "written for another device or driver";
+            return {};
+        }
+
+        std::vector<char> data(header.dataSize);
+        file.read(data.data(), data.size());
+        if (!file || hashBytes(data.data(), data.size()) != header.dataHash) {
+            pipelineCacheStatus = "file corrupted";
+            return {};
+        }
+
+        // the blob starts with a VkPipelineCacheHeaderVersionOne: length, version, vendor, device, then the UUID
+        uint32_t blobHeader[4] = {};
+        if (data.size() >= sizeof(blobHeader) + VK_UUID_SIZE) {
+            memcpy(blobHeader, data.data(), sizeof(blobHeader));
+        }
+        if (blobHeader[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE || blobHeader[2] != properties.vendorID ||
+            blobHeader[3] != properties.deviceID ||
+            memcmp(data.data() + sizeof(blobHeader), properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            pipelineCacheStatus = "blob header doesn't match the device";
+            return {};
+        }
+
+        pipelineCacheStatus = "loaded " + std::to_string(data.size() / 1024) + "KiB from " + settings.pipelineCachePath;
+        return data;
+    }
+
+    void createPipelineCache() {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+        std::vector<char> data;
+        if (settings.pipelineCachePath.empty()) {
+            pipelineCacheStatus = "disabled";
+        } else {
+            data = loadPipelineCacheData(properties);
+        }
+
+        VkPipelineCacheCreateInfo cacheInfo{};
+        cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        cacheInfo.initialDataSize = data.size(); // 0 starts empty
+        cacheInfo.pInitialData = data.data();
+
+        if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create pipeline cache!");
+        }
+        pipelineCacheWarm = !data.empty();
+        pipelineCacheSavedSize = data.size();
+        lastPipelineCacheSave = glfwGetTime();
+        startPipelineWorkers(data);
+    }
+
+    // writes the cache to a temporary file and renames it over the old one, so a crash while saving never leaves
+    // a half written cache behind. Called on exit and every pipelineCacheSaveSeconds. A failed save is not worth
+    // stopping for, the next run just starts colder.
+    void savePipelineCache() {
+        lastPipelineCacheSave = glfwGetTime();
+        if (settings.pipelineCachePath.empty() || pipelineCache == VK_NULL_HANDLE) {
+            return;
+        }
+
+        size_t size = 0;
+        vkGetPipelineCacheData(device, pipelineCache, &size, nullptr);
+        if (size == pipelineCacheSavedSize) {
+            return; // the driver only adds to the cache, so nothing was compiled since the last save
+        }
+        std::vector<char> data(size);
+        if (vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS) {
+            std::cerr << "failed to get the pipeline cache data" << std::endl;
+            return;
+        }
+        data.resize(size);
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        PipelineCacheFileHeader header{};
+        header.magic = pipelineCacheMagic;
+        header.vendorID = properties.vendorID;
+        header.deviceID = properties.deviceID;
+        header.driverVersion = properties.driverVersion;
+        memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+        header.dataSize = data.size();
+        header.dataHash = hashBytes(data.data(), data.size());
+
+        std::string temporaryPath = settings.pipelineCachePath + ".tmp";
+        {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(data.data(), data.size());
+            if (!file) {
+                std::cerr << "failed to write " << temporaryPath << std::endl;
+                return;
+            }
+        }
+        if (std::rename(temporaryPath.c_str(), settings.pipelineCachePath.c_str()) != 0) {
+            // rename doesn't replace an existing file on Windows
+            std::remove(settings.pipelineCachePath.c_str());
+            if (std::rename(temporaryPath.c_str(), settings.pipelineCachePath.c_str()) != 0) {
+                std::cerr << "failed to replace " << settings.pipelineCachePath << std::endl;
+                return;
+            }
+        }
+        pipelineCacheSavedSize = data.size();
+        pipelineCacheSaves++;
+    }
+
+    // the layout outlives the pipelines, they are built again when reloading but it stays the same
+    void createPipelineLayout() {
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 0; // Optional
+        pipelineLayoutInfo.pSetLayouts = nullptr; // Optional
+        pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
+        pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+
+        if(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create pipeline layout!");
+        }
+    }
+
+    // the state of a material's pipeline. The materials are permutations of the same pipeline, only the blending,
+    // the culling or the shader variant changes.
+    PipelineDesc describeMaterialPipeline(Material material, const PipelineShaderCode& shaders) {
+        PipelineDesc desc{};
+        // the instanced vertex shader reads a transform and a color per instance
+        desc.instanced = settings.instanceCount > 0;
+        desc.vertexShader = desc.instanced ? PipelineShader::InstancedVertex : PipelineShader::Vertex;
+        desc.fragmentShader = PipelineShader::Fragment;
+        desc.vertexShaderHash = shaders.hashes[(size_t) desc.vertexShader];
+        desc.fragmentShaderHash = shaders.hashes[(size_t) desc.fragmentShader];
+        desc.fragmentVariant = {0, VK_FALSE, 0.5f, 4.0f}; // the defaults of shader.frag
+
+        desc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST; // triangle from every 3 vertices without reuse
+        desc.polygonMode = VK_POLYGON_MODE_FILL; // fill the area of the polygon with fragments
+        desc.cullMode = VK_CULL_MODE_BACK_BIT; // specifies that front-facing triangles are discarded
+        desc.frontFace = VK_FRONT_FACE_CLOCKWISE; // specifies that a triangle with negative area is considered front-facing.
+        desc.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+        desc.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+        desc.blendEnable = VK_FALSE;
+        desc.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+        desc.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+        desc.colorBlendOp = VK_BLEND_OP_ADD;
+        desc.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        desc.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+        desc.alphaBlendOp = VK_BLEND_OP_ADD;
+        if (material == Material::Additive) {
+            desc.blendEnable = VK_TRUE;
+            desc.dstColorBlendFactor = VK_BLEND_FACTOR_ONE; // source + destination
+        } else if (material == Material::DoubleSided) {
+            desc.cullMode = VK_CULL_MODE_NONE;
+        } else if (material == Material::Banded) {
+            desc.fragmentVariant.lightingModel = 1;
+        } else if (material == Material::Cutout) {
+            desc.fragmentVariant.alphaTest = VK_TRUE; // cuts the triangle in stripes
+        }
+
+        // a pipeline works with any render pass compatible with the one it was created with, ours only depends
+        // on the color format
+        desc.colorFormat = swapChainImageFormat;
+        desc.subpass = 0;
+        return desc;
+    }
+
+    // reads every pipeline shader once, the descriptions hash this code and the pipelines are built from it
+    static std::shared_ptr<const PipelineShaderCode> loadPipelineShaders() {
+        auto shaders = std::make_shared<PipelineShaderCode>();
+        for (size_t shader = 0; shader < (size_t) PipelineShader::Count; shader++) {
+            shaders->code[shader] = readFile(pipelineShaderFiles[shader]);
+            shaders->hashes[shader] = hashBytes(shaders->code[shader].data(), shaders->code[shader].size());
+        }
+        return shaders;
+    }
+
+    // With extended dynamic state the states the materials differ in are set while recording instead, so they are
+    // reset to the same value in every material's description, and the registry gives them all the same pipeline.
+    // Depth test would be one of them, but the render pass has no depth attachment.
+    PipelineDesc makeStateDynamic(PipelineDesc desc) {
+        if (dynamicRasterState) {
+            desc.dynamicRasterState = VK_TRUE;
+            desc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+            desc.cullMode = VK_CULL_MODE_NONE;
+            desc.frontFace = VK_FRONT_FACE_CLOCKWISE;
+        }
+        if (dynamicBlendState) {
+            desc.dynamicBlendState = VK_TRUE;
+            desc.blendEnable = VK_FALSE;
+            desc.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            desc.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+            desc.colorBlendOp = VK_BLEND_OP_ADD;
+            desc.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+            desc.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            desc.alphaBlendOp = VK_BLEND_OP_ADD;
+        }
+        return desc;
+    }
+
+    // how many pipelines the materials of the scene need, with or without the dynamic states
+    size_t countMaterialPipelines(bool dynamic) {
+        std::vector<PipelineDesc> unique;
+        for (uint32_t material = 0; material < settings.materialCount; material++) {
+            PipelineDesc desc = dynamic ? makeStateDynamic(materialStates[material]) : materialStates[material];
+            if (std::none_of(unique.begin(), unique.end(),
+                    [&](const PipelineDesc& other) { return memcmp(&desc, &other, sizeof(desc)) == 0; })) {
+                unique.push_back(desc);
+            }
+        }
+        return unique.size();
+    }
+
+    // the pipeline of a material's state, from the registry: built only if no pipeline with the same state exists
+    // yet. shaders must be the code the state was described from. Safe to call from several threads, each with its
+    // own cache.
+    VkPipeline createMaterialPipeline(const PipelineDesc& state, const PipelineShaderCode& shaders, VkPipelineCache cache) {
+        PipelineDesc desc = makeStateDynamic(state);
+        return pipelineRegistry.acquire(device, desc, [&] { return createPipeline(desc, shaders, cache); });
+    }
 
-        VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-        VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+    VkPipeline createPipeline(const PipelineDesc& desc, const PipelineShaderCode& shaders, VkPipelineCache cache) {
+        bool instanced = desc.instanced != 0;
+        VkShaderModule vertShaderModule = createShaderModule(shaders.code[(size_t) desc.vertexShader]);
+        VkShaderModule fragShaderModule = createShaderModule(shaders.code[(size_t) desc.fragmentShader]);
 
         VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
         vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -650,6 +2360,14 @@ private:
         fragShaderStageInfo.module = fragShaderModule;
         fragShaderStageInfo.pName = "main";
 
+        // the features of the fragment shader, the constants are replaced before the driver compiles it
+        VkSpecializationInfo fragSpecializationInfo{};
+        fragSpecializationInfo.mapEntryCount = static_cast<uint32_t>(std::size(shaderVariantEntries));
+        fragSpecializationInfo.pMapEntries = shaderVariantEntries;
+        fragSpecializationInfo.dataSize = sizeof(desc.fragmentVariant);
+        fragSpecializationInfo.pData = &desc.fragmentVariant;
+        fragShaderStageInfo.pSpecializationInfo = &fragSpecializationInfo;
+
         VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
 
         // for now we are hardcoding the vertex data in the vertex shader, so no vertex data to load (nullptr for now).
@@ -660,33 +2378,43 @@ private:
         vertexInputInfo.vertexAttributeDescriptionCount = 0;
         vertexInputInfo.pVertexAttributeDescriptions = nullptr; // Optional
 
+        // except for the instanced pipeline: one InstanceData per instance, from binding 0
+        VkVertexInputBindingDescription instanceBinding{};
+        instanceBinding.binding = 0;
+        instanceBinding.stride = sizeof(InstanceData);
+        instanceBinding.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE; // move to the next entry after each instance, not vertex
+
+        VkVertexInputAttributeDescription instanceAttributes[2]{};
+        instanceAttributes[0].binding = 0;
+        instanceAttributes[0].location = 0; // instanceTransform
+        instanceAttributes[0].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+        instanceAttributes[0].offset = offsetof(InstanceData, transform);
+        instanceAttributes[1].binding = 0;
+        instanceAttributes[1].location = 1; // instanceColor
+        instanceAttributes[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+        instanceAttributes[1].offset = offsetof(InstanceData, color);
+
+        if (instanced) {
+            vertexInputInfo.vertexBindingDescriptionCount = 1;
+            vertexInputInfo.pVertexBindingDescriptions = &instanceBinding;
+            vertexInputInfo.vertexAttributeDescriptionCount = 2;
+            vertexInputInfo.pVertexAttributeDescriptions = instanceAttributes;
+        }
+
         VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
         inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST; // triangle from every 3 vertices without reuse
+        inputAssembly.topology = desc.topology;
         inputAssembly.primitiveRestartEnable = VK_FALSE;
 
-        // viewport is the region of the framebuffer that the output will be rendered to
-        // we want it to extend fully to the "buffer" we are drawing to.
-        VkViewport viewport{};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = (float) swapChainExtent.width;
-        viewport.height = (float) swapChainExtent.height;
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
-
-        //we want to draw in the entire framebuffer
-        VkRect2D scissor{};
-        scissor.offset = {0, 0};
-        scissor.extent = swapChainExtent;
-
-        //combines viewport and scissor in a viewport state
+        // viewport is the region of the framebuffer that the output will be rendered to, scissor the region that is kept.
+        // both are dynamic state set while recording the command buffers, so the pipeline survives window resizes,
+        // here we only say how many we use.
         VkPipelineViewportStateCreateInfo viewportState{};
         viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
         viewportState.viewportCount = 1;
-        viewportState.pViewports = &viewport;
+        viewportState.pViewports = nullptr; // dynamic
         viewportState.scissorCount = 1;
-        viewportState.pScissors = &scissor;
+        viewportState.pScissors = nullptr; // dynamic
 
         // the rasterizer takes assembled primitives that are still represented by a sequence of vertices
         // and turns them into individual fragments to be colored by the fragments shader
@@ -694,10 +2422,10 @@ private:
         rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
         rasterizer.depthClampEnable = VK_FALSE; // no clamping of fragments that are beyond the near and far planes
         rasterizer.rasterizerDiscardEnable = VK_FALSE; // we want the geometry to pass through the rasterizer stage
-        rasterizer.polygonMode = VK_POLYGON_MODE_FILL; // fill the area of the polygon with fragments
+        rasterizer.polygonMode = desc.polygonMode;
         rasterizer.lineWidth = 1.0f;
-        rasterizer.cullMode = VK_CULL_MODE_BACK_BIT; // specifies that front-facing triangles are discarded
-        rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE; // specifies that a triangle with negative area is considered front-facing.
+        rasterizer.cullMode = desc.cullMode;
+        rasterizer.frontFace = desc.frontFace;
         rasterizer.depthBiasClamp = VK_FALSE;
         rasterizer.depthBiasConstantFactor = 0.0f; // Optional
         rasterizer.depthBiasClamp = 0.0f; // Optional
@@ -707,7 +2435,7 @@ private:
         VkPipelineMultisampleStateCreateInfo multisampling{};
         multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
         multisampling.sampleShadingEnable = VK_FALSE;
-        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+        multisampling.rasterizationSamples = desc.rasterizationSamples;
         multisampling.minSampleShading = 1.0f; // Optional
         multisampling.pSampleMask = nullptr; // Optional
         multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
@@ -715,14 +2443,14 @@ private:
 
         // color blending configuration with what is already in the framebuffer
         VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-        colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-        colorBlendAttachment.blendEnable = VK_FALSE;
-        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-        colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-        colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
-        colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-        colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-        colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
+        colorBlendAttachment.colorWriteMask = desc.colorWriteMask;
+        colorBlendAttachment.blendEnable = desc.blendEnable;
+        colorBlendAttachment.srcColorBlendFactor = desc.srcColorBlendFactor;
+        colorBlendAttachment.dstColorBlendFactor = desc.dstColorBlendFactor;
+        colorBlendAttachment.colorBlendOp = desc.colorBlendOp;
+        colorBlendAttachment.srcAlphaBlendFactor = desc.srcAlphaBlendFactor;
+        colorBlendAttachment.dstAlphaBlendFactor = desc.dstAlphaBlendFactor;
+        colorBlendAttachment.alphaBlendOp = desc.alphaBlendOp;
 
         VkPipelineColorBlendStateCreateInfo colorBlending{};
         colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
@@ -735,26 +2463,25 @@ private:
         colorBlending.blendConstants[2] = 0.0f; // Optional
         colorBlending.blendConstants[3] = 0.0f; // Optional
 
-        // necessary to modify viewport and line width dynamically without recreating the pipeline
-        VkDynamicState dynamicStates[] = {
+        // necessary to modify viewport and scissor dynamically without recreating the pipeline
+        std::vector<VkDynamicState> dynamicStates = {
                 VK_DYNAMIC_STATE_VIEWPORT,
-                VK_DYNAMIC_STATE_LINE_WIDTH
+                VK_DYNAMIC_STATE_SCISSOR
         };
+        // with extended dynamic state (--dynamic-state) the values baked above are ignored, see setRasterState
+        if (desc.dynamicRasterState) {
+            dynamicStates.push_back(VK_DYNAMIC_STATE_CULL_MODE_EXT);
+            dynamicStates.push_back(VK_DYNAMIC_STATE_FRONT_FACE_EXT);
+            dynamicStates.push_back(VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT);
+        }
+        if (desc.dynamicBlendState) {
+            dynamicStates.push_back(VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT);
+            dynamicStates.push_back(VK_DYNAMIC_STATE_COLOR_BLEND_EQUATION_EXT);
+        }
         VkPipelineDynamicStateCreateInfo dynamicState{};
         dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-        dynamicState.dynamicStateCount = 2;
-        dynamicState.pDynamicStates = dynamicStates;
-
-        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        pipelineLayoutInfo.setLayoutCount = 0; // Optional
-        pipelineLayoutInfo.pSetLayouts = nullptr; // Optional
-        pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-        pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
-
-        if(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
-            throw std::runtime_error("failed to create pipeline layout!");
-        }
+        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+        dynamicState.pDynamicStates = dynamicStates.data();
 
         VkGraphicsPipelineCreateInfo pipelineInfo{};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -767,20 +2494,158 @@ private:
         pipelineInfo.pMultisampleState = &multisampling; // fixed-function stage
         pipelineInfo.pDepthStencilState = nullptr; // fixed-function stage
         pipelineInfo.pColorBlendState = &colorBlending; // fixed-function stage
-        pipelineInfo.pDynamicState = nullptr;  // fixed-function stage
+        pipelineInfo.pDynamicState = &dynamicState;  // fixed-function stage
         pipelineInfo.layout = pipelineLayout;
         pipelineInfo.renderPass = renderPass;
-        pipelineInfo.subpass = 0;
+        pipelineInfo.subpass = desc.subpass;
         pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // we are not deriving from an existing pipeline (Optional)
         pipelineInfo.basePipelineIndex = -1; // we are not deriving from an existing pipeline (Optional)
 
-        if(vkCreateGraphicsPipelines(
-                device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS) {
-            throw std::runtime_error("failed to create graphics pipeline!");
-        }
+        VkPipeline pipeline;
+        VkResult result = vkCreateGraphicsPipelines(device, cache, 1, &pipelineInfo, nullptr, &pipeline);
 
         vkDestroyShaderModule(device, fragShaderModule, nullptr);
         vkDestroyShaderModule(device, vertShaderModule, nullptr);
+        if (result != VK_SUCCESS) {
+            throw std::runtime_error("failed to create graphics pipeline!");
+        }
+        return pipeline;
+    }
+
+    // builds the pipeline of every material. With --async-pipelines only the fallback is built here, the others
+    // are compiled in the background the first time a draw needs them (see queueDraws).
+    void createGraphicsPipeline() {
+        pipelineGeneration++; // anything still compiling is for the previous pipelines
+        pipelineShaders = loadPipelineShaders(); // the files may have changed since the last time, see reloadPipelines()
+        materialStates.clear();
+        for (uint32_t material = 0; material < (uint32_t) Material::Count; material++) {
+            materialStates.push_back(describeMaterialPipeline((Material) material, *pipelineShaders));
+        }
+        graphicsPipelines.assign((size_t) Material::Count, VK_NULL_HANDLE);
+        pipelineRequested.assign((size_t) Material::Count, false);
+        for (uint32_t material = 0; material < (uint32_t) Material::Count; material++) {
+            if (settings.asyncPipelines == AsyncPipelines::Off || (Material) material == fallbackMaterial) {
+                graphicsPipelines[material] = createMaterialPipeline(materialStates[material], *pipelineShaders, pipelineCache);
+                pipelineRequested[material] = true;
+            }
+        }
+    }
+
+    // queues the compilation of a material's pipeline on the pipeline workers. Each worker has its own cache, so
+    // they don't contend on the main one, the caches are merged into it once nothing is compiling.
+    void requestPipeline(Material material) {
+        if (pipelineRequested[(size_t) material]) {
+            return;
+        }
+        pipelineRequested[(size_t) material] = true;
+        pipelinesCompiling++;
+
+        // a reload replaces the states and the shader code while this compiles, so it gets its own copies
+        uint64_t generation = pipelineGeneration;
+        PipelineDesc state = materialStates[(size_t) material];
+        std::shared_ptr<const PipelineShaderCode> shaders = pipelineShaders;
+        pipelineWorkers.submit([this, material, generation, state, shaders](uint32_t worker) {
+            CompiledPipeline compiled{material, generation, VK_NULL_HANDLE, 0.0, {}};
+            double start = glfwGetTime();
+            try {
+                compiled.pipeline = createMaterialPipeline(state, *shaders, pipelineWorkerCaches[worker]);
+            } catch (const std::exception& e) {
+                compiled.error = e.what();
+            }
+            compiled.compileTime = (glfwGetTime() - start) * 1000.0;
+
+            std::lock_guard<std::mutex> lock(compiledPipelinesMutex);
+            compiledPipelines.push_back(std::move(compiled));
+        });
+    }
+
+    // renderer side, at the start of a frame: starts using the pipelines the workers finished
+    void collectCompiledPipelines() {
+        std::vector<CompiledPipeline> compiled;
+        {
+            std::lock_guard<std::mutex> lock(compiledPipelinesMutex);
+            compiled.swap(compiledPipelines);
+        }
+        if (compiled.empty()) {
+            return;
+        }
+
+        bool installed = false;
+        for (auto& result : compiled) {
+            pipelinesCompiling--;
+            if (!result.error.empty()) {
+                throw std::runtime_error(result.error);
+            }
+            if (result.generation != pipelineGeneration) {
+                pipelineRegistry.release(device, result.pipeline); // the pipelines were reloaded meanwhile, never used
+                continue;
+            }
+            graphicsPipelines[(size_t) result.material] = result.pipeline;
+            asyncPipelineStats.add(result.compileTime);
+            installed = true;
+        }
+
+        if (pipelinesCompiling == 0) {
+            mergePipelineWorkerCaches(); // every task pushed its result, so no worker uses its cache
+        }
+        if (installed && settings.recordMode == RecordMode::PreRecorded) {
+            // the pre-recorded command buffers draw with the fallback or skip draws. The draw order changes too,
+            // and the indirect parameters in slot 0 follow it, but frames in flight read them: wait for those once.
+            if (drawPath != DrawPath::Direct) {
+                waitForSubmissionValue(lastSubmittedValue);
+                staticIndirectArgsWritten = false;
+            }
+            recreatePreRecordedCommandBuffers();
+        }
+    }
+
+    void mergePipelineWorkerCaches() {
+        if (pipelineWorkerCaches.empty()) {
+            return;
+        }
+        if (vkMergePipelineCaches(device, pipelineCache, static_cast<uint32_t>(pipelineWorkerCaches.size()),
+                                  pipelineWorkerCaches.data()) != VK_SUCCESS) {
+            std::cerr << "failed to merge the pipeline caches of the workers" << std::endl;
+        }
+    }
+
+    // pipeline workers and their caches, they start with what was loaded from disk
+    void startPipelineWorkers(const std::vector<char>& initialData) {
+        if (settings.asyncPipelines == AsyncPipelines::Off) {
+            return;
+        }
+
+        uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency() / 2);
+        pipelineWorkerCaches.resize(threadCount);
+        for (auto& cache : pipelineWorkerCaches) {
+            VkPipelineCacheCreateInfo cacheInfo{};
+            cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+            cacheInfo.initialDataSize = initialData.size();
+            cacheInfo.pInitialData = initialData.data();
+            if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create pipeline cache!");
+            }
+        }
+        pipelineWorkers.start(threadCount);
+    }
+
+    // lets the workers finish what they started, throws away what they built and merges their caches, before
+    // the main cache is saved
+    void stopPipelineWorkers() {
+        if (pipelineWorkerCaches.empty()) {
+            return;
+        }
+
+        pipelineWorkers.stop();
+        for (auto& result : compiledPipelines) {
+            pipelineRegistry.release(device, result.pipeline);
+        }
+        compiledPipelines.clear();
+        mergePipelineWorkerCaches();
+        for (auto cache : pipelineWorkerCaches) {
+            vkDestroyPipelineCache(device, cache, nullptr);
+        }
+        pipelineWorkerCaches.clear();
     }
 
     void createFramebuffers() {
@@ -814,16 +2679,133 @@ private:
         VkCommandPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
         poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-        poolInfo.flags = 0;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // so an animated scene can re-record a single command buffer
 
         if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
             throw std::runtime_error("failed to create command pool!");
         }
     }
 
+    // graphics cards offer different types of memory, each allowing different operations and performance characteristics
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+        VkPhysicalDeviceMemoryProperties memProperties;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+            if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                return i;
+            }
+        }
+
+        throw std::runtime_error("failed to find suitable memory type!");
+    }
+
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = usage;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // only used by the graphics queue
+
+        if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create buffer!");
+        }
+
+        VkMemoryRequirements memRequirements;
+        vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = memRequirements.size;
+        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+
+        if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate buffer memory!");
+        }
+
+        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+    }
+
+    // the index buffer and the per frame slot indirect buffers. They are small and written by the CPU every frame,
+    // so they live in host visible memory, coherent so nothing needs flushing.
+    void createIndirectBuffers() {
+        if (drawPath == DrawPath::Direct) {
+            return;
+        }
+
+        const VkMemoryPropertyFlags hostMemory = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        const uint16_t indices[] = {0, 1, 2};
+        createBuffer(sizeof(indices), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, hostMemory, indexBuffer, indexBufferMemory);
+        void* data;
+        vkMapMemory(device, indexBufferMemory, 0, sizeof(indices), 0, &data);
+        memcpy(data, indices, sizeof(indices));
+        vkUnmapMemory(device, indexBufferMemory);
+
+        indirectArgBuffers.resize(settings.maxFramesInFlight);
+        indirectArgMemories.resize(settings.maxFramesInFlight);
+        indirectArgs.resize(settings.maxFramesInFlight);
+        indirectCountBuffers.resize(settings.maxFramesInFlight);
+        indirectCountMemories.resize(settings.maxFramesInFlight);
+        indirectCounts.resize(settings.maxFramesInFlight);
+        for (int i = 0; i < settings.maxFramesInFlight; i++) {
+            createBuffer(settings.drawCount * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                         hostMemory, indirectArgBuffers[i], indirectArgMemories[i]);
+            vkMapMemory(device, indirectArgMemories[i], 0, VK_WHOLE_SIZE, 0, &data);
+            indirectArgs[i] = static_cast<VkDrawIndexedIndirectCommand*>(data);
+
+            createBuffer(settings.drawCount * sizeof(uint32_t), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                         hostMemory, indirectCountBuffers[i], indirectCountMemories[i]);
+            vkMapMemory(device, indirectCountMemories[i], 0, VK_WHOLE_SIZE, 0, &data);
+            indirectCounts[i] = static_cast<uint32_t*>(data);
+        }
+    }
+
+    // with RecordMode::Transient and Cached each frame slot gets its own pool and a command buffer in it
+    void createFrameCommandPools() {
+        if (settings.recordMode == RecordMode::PreRecorded) {
+            return;
+        }
+
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+        frameCommandPools.resize(settings.maxFramesInFlight);
+        frameCommandBuffers.resize(settings.maxFramesInFlight);
+        if (settings.recordMode == RecordMode::CommandList) {
+            for (int i = 0; i < settings.maxFramesInFlight; i++) {
+                // a guess of a few commands per draw, it grows if that's not enough
+                frameArenas.emplace_back(new FrameArena(64 * 1024 + settings.drawCount * 2 * sizeof(Command)));
+            }
+        }
+
+        for (int i = 0; i < settings.maxFramesInFlight; i++) {
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT; // no individual reset, the whole pool is reset each frame
+
+            if (vkCreateCommandPool(device, &poolInfo, nullptr, &frameCommandPools[i]) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create frame command pool!");
+            }
+
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = frameCommandPools[i];
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
+
+            if (vkAllocateCommandBuffers(device, &allocInfo, &frameCommandBuffers[i]) != VK_SUCCESS) {
+                throw std::runtime_error("failed to allocate command buffers!");
+            }
+        }
+    }
+
     void createCommandBuffers() {
+        if (settings.recordMode != RecordMode::PreRecorded) {
+            return; // recorded every frame into the frame command pools instead
+        }
+
         // start allocating command buffers and recording drawing commands in them.
         // one of the drawing commands involves binding the right VkFramebuffer
+        double start = glfwGetTime();
         commandBuffers.resize(swapChainFramebuffers.size());
         VkCommandBufferAllocateInfo allocInfo{};
         allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -835,94 +2817,1459 @@ private:
             throw std::runtime_error("failed to allocate command buffers!");
         }
 
+        queueDraws((uint32_t) currentFrame);
         for (size_t i = 0; i < commandBuffers.size(); i++) {
-            VkCommandBufferBeginInfo beginInfo{};
-            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            beginInfo.flags = 0; // no flag (Optional)
-            beginInfo.pInheritanceInfo = nullptr; // Optional
+            recordCommandBuffer(commandBuffers[i], i);
+        }
+        preRecordStats.add((glfwGetTime() - start) * 1000.0);
+    }
 
-            // begin recording command buffer
-            if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS) {
-                throw std::runtime_error("failed to begin recording command buffer!");
+    // spreads the draws evenly over the cells, in cell order. The materials alternate, so drawing in this order
+    // would switch pipelines all the time.
+    void buildScene() {
+        drawList.resize(settings.drawCount);
+        for (uint32_t i = 0; i < settings.drawCount; i++) {
+            DrawCommand& draw = drawList[i];
+            draw.material = (Material) (i % settings.materialCount);
+            draw.cell = (uint32_t) ((uint64_t) i * settings.cellCount / settings.drawCount);
+            draw.vertexCount = 3; // the vertices are in the vertex shader
+            draw.instanceCount = 1;
+            draw.firstVertex = 0;
+            draw.firstInstance = 0;
+            if (settings.instanceCount > 0) {
+                // each draw gets the next range of the instance buffer
+                draw.firstInstance = (uint32_t) ((uint64_t) i * settings.instanceCount / settings.drawCount);
+                draw.instanceCount = (uint32_t) ((uint64_t) (i + 1) * settings.instanceCount / settings.drawCount) - draw.firstInstance;
             }
+        }
+    }
 
-            VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
-            VkRenderPassBeginInfo renderPassInfo{};
-            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            renderPassInfo.renderPass = renderPass;
-            renderPassInfo.framebuffer = swapChainFramebuffers[i];
-            renderPassInfo.renderArea.offset = {0, 0};
-            renderPassInfo.renderArea.extent = swapChainExtent;
-            renderPassInfo.clearValueCount = 1;         //  define the clear values to use for VK_ATTACHMENT_LOAD_OP_CLEAR,
-            renderPassInfo.pClearValues = &clearColor;  // which we used as load operation for the color attachment
-            vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE); // returns void, no error handling until finish
+    // the instances are laid out on a square grid filling the viewport, colored along a hue gradient.
+    // They never change, so the buffer is written once.
+    void createInstanceBuffer() {
+        if (settings.instanceCount == 0) {
+            return;
+        }
 
-            vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline); // bind the graphics pipeline
+        VkDeviceSize size = (VkDeviceSize) settings.instanceCount * sizeof(InstanceData);
+        createBuffer(size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     instanceBuffer, instanceBufferMemory);
+
+        void* data;
+        vkMapMemory(device, instanceBufferMemory, 0, size, 0, &data);
+        InstanceData* instances = static_cast<InstanceData*>(data);
+        uint32_t columns = (uint32_t) std::ceil(std::sqrt((double) settings.instanceCount));
+        float spacing = 2.0f / (float) columns; // clip space goes from -1 to 1
+        for (uint32_t i = 0; i < settings.instanceCount; i++) {
+            InstanceData instance{};
+            instance.transform[0] = -1.0f + spacing * ((float) (i % columns) + 0.5f);
+            instance.transform[1] = -1.0f + spacing * ((float) (i / columns) + 0.5f);
+            instance.transform[2] = spacing; // the triangle is 1 wide, a bit of overlap is fine
+            instance.transform[3] = spacing;
+            float hue = (float) i / (float) settings.instanceCount;
+            instance.color[0] = 0.5f + 0.5f * std::cos(6.2831853f * hue);
+            instance.color[1] = 0.5f + 0.5f * std::cos(6.2831853f * (hue - 1.0f / 3.0f));
+            instance.color[2] = 0.5f + 0.5f * std::cos(6.2831853f * (hue - 2.0f / 3.0f));
+            instances[i] = instance; // one write per instance, this memory may be uncached
+        }
+        vkUnmapMemory(device, instanceBufferMemory);
+    }
 
-            // Draw command parameters
-            // vertexCount: Even though we don't have a vertex buffer, we technically still have 3 vertices to draw.
-            // instanceCount: Used for instanced rendering, use 1 if you're not doing that.
-            // firstVertex: Used as an offset into the vertex buffer, defines the lowest value of gl_VertexIndex.
-            // firstInstance: Used as an offset for instanced rendering, defines the lowest value of gl_InstanceIndex.
-            vkCmdDraw(commandBuffers[i], 3, 1, 0, 0);
+    // pushes every draw to the queue and sorts it. There's one pass, no descriptor sets yet, the cell is the
+    // material parameter (it sets the viewport) and draws in the same cell keep their list order as depth.
+    void queueDraws(uint32_t frameSlot) {
+        double start = glfwGetTime();
+        drawQueue.clear();
+        for (uint32_t i = 0; i < (uint32_t) drawList.size(); i++) {
+            const DrawCommand& draw = drawList[i];
+            uint32_t pipeline = (uint32_t) draw.material;
+            if (graphicsPipelines[pipeline] == VK_NULL_HANDLE) {
+                // not compiled yet (--async-pipelines), draw it with the fallback or not at all meanwhile
+                requestPipeline(draw.material);
+                if (settings.asyncPipelines == AsyncPipelines::Skip) {
+                    pipelineSkippedDraws++;
+                    continue;
+                }
+                pipeline = (uint32_t) fallbackMaterial;
+                pipelineFallbackDraws++;
+            }
+            drawQueue.push(makeSortKey(0, pipeline, 0, draw.cell, i), i);
+        }
+        drawQueue.sort();
 
-            vkCmdEndRenderPass(commandBuffers[i]); // ends the render pass
+        if (settings.recordMode == RecordMode::Cached) {
+            // the cells are cached one by one, they keep the order of the queue
+            cellPackets.resize(settings.cellCount);
+            for (auto& packets : cellPackets) {
+                packets.clear();
+            }
+            for (const auto& packet : drawQueue.sorted()) {
+                cellPackets[drawList[packet.drawIndex].cell].push_back(packet);
+            }
+        }
+        writeIndirectArgs(frameSlot);
+        drawSortStats.add((glfwGetTime() - start) * 1000.0);
+    }
 
-            if(vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-                throw std::runtime_error("failed to record command buffer!");
+    // writes the parameters of every draw in the buffers of the frame slot, in the order they are recorded:
+    // the order of the queue, or cell by cell when the cells are cached
+    void writeIndirectArgs(uint32_t frameSlot) {
+        if (drawPath == DrawPath::Direct) {
+            return;
+        }
+        if (settings.recordMode == RecordMode::PreRecorded) {
+            // every pre-recorded command buffer reads slot 0. The draw list doesn't change after startup,
+            // so it's written once instead of while frames in flight read it.
+            if (staticIndirectArgsWritten) {
+                return;
             }
+            frameSlot = 0;
+            staticIndirectArgsWritten = true;
+        }
 
+        std::vector<const DrawPacket*> order;
+        order.reserve(drawQueue.size());
+        if (settings.recordMode == RecordMode::Cached) {
+            cellFirstArg.resize(settings.cellCount);
+            for (uint32_t cell = 0; cell < settings.cellCount; cell++) {
+                cellFirstArg[cell] = (uint32_t) order.size();
+                for (const auto& packet : cellPackets[cell]) {
+                    order.push_back(&packet);
+                }
+            }
+        } else {
+            for (const auto& packet : drawQueue.sorted()) {
+                order.push_back(&packet);
+            }
         }
 
+        VkDrawIndexedIndirectCommand* args = indirectArgs[frameSlot];
+        uint32_t* counts = indirectCounts[frameSlot];
+        for (size_t i = 0; i < order.size(); i++) {
+            const DrawCommand& draw = drawList[order[i]->drawIndex];
+            args[i].indexCount = draw.vertexCount; // the index buffer counts 0, 1, 2...
+            args[i].instanceCount = draw.instanceCount;
+            args[i].firstIndex = 0;
+            args[i].vertexOffset = (int32_t) draw.firstVertex;
+            args[i].firstInstance = draw.firstInstance;
+        }
 
+        // from the end, so each draw knows how many of its batch follow. A slice of the queue starting in the
+        // middle of a batch still finds the right count.
+        for (size_t i = order.size(); i-- > 0;) {
+            const DrawCommand& draw = drawList[order[i]->drawIndex];
+            counts[i] = 1;
+            if (i + 1 < order.size()) {
+                const DrawCommand& next = drawList[order[i + 1]->drawIndex];
+                if (sortKeyPipeline(order[i + 1]->key) == sortKeyPipeline(order[i]->key) && next.cell == draw.cell) {
+                    counts[i] = counts[i + 1] + 1;
+                }
+            }
+        }
     }
 
-    void createSemaphores() {
-        VkSemaphoreCreateInfo semaphoreInfo{};
-        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-        if(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphore) != VK_SUCCESS ||
-           vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphore) != VK_SUCCESS) {
-            throw std::runtime_error("failed to create semaphores!");
+    // the window is a grid of cells, the triangles of a cell are drawn in a viewport covering it
+    VkViewport cellViewport(uint32_t cell) {
+        uint32_t columns = (uint32_t) std::ceil(std::sqrt((double) settings.cellCount));
+        uint32_t rows = (settings.cellCount + columns - 1) / columns;
+        float cellWidth = (float) swapChainExtent.width / (float) columns;
+        float cellHeight = (float) swapChainExtent.height / (float) rows;
+
+        VkViewport viewport{};
+        viewport.x = (float) (cell % columns) * cellWidth;
+        viewport.y = (float) (cell / columns) * cellHeight;
+        viewport.width = cellWidth;
+        viewport.height = cellHeight;
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
+        if (cell == 0) {
+            // moved around by the simulation
+            viewport.x += renderState.offsetX * cellWidth;
+            viewport.y += renderState.offsetY * cellHeight;
         }
+        return viewport;
     }
 
-    void drawFrame() {
-        uint32_t imageIndex;
+    void createBucketCache() {
+        if (settings.recordMode != RecordMode::Cached) {
+            return;
+        }
 
-        // acquire the image from the swapchain
-        vkAcquireNextImageKHR(device, swapChain, UINT64_MAX /*disable timeout*/,
-                imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+        bucketCachePools.resize(settings.maxFramesInFlight);
+        bucketCache.resize(settings.maxFramesInFlight);
+        for (int i = 0; i < settings.maxFramesInFlight; i++) {
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // only the changed buckets are recorded again
+
+            if (vkCreateCommandPool(device, &poolInfo, nullptr, &bucketCachePools[i]) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create bucket cache command pool!");
+            }
 
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            std::vector<VkCommandBuffer> buffers(settings.cellCount);
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = bucketCachePools[i];
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            allocInfo.commandBufferCount = settings.cellCount;
 
-        VkSemaphore waitSemaphores[] = {imageAvailableSemaphore}; // which semaphores to wait on before execution begins
-        VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT}; // which stage(s) of the pipeline to wait
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = waitSemaphores;
-        submitInfo.pWaitDstStageMask = waitStages;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[imageIndex]; // which command buffers to submit for execution
-        VkSemaphore signalSemaphores[] = {renderFinishedSemaphore};
-        submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pSignalSemaphores = signalSemaphores; // which semaphores to signal once the command buffer(s) have finished execution
+            if (vkAllocateCommandBuffers(device, &allocInfo, buffers.data()) != VK_SUCCESS) {
+                throw std::runtime_error("failed to allocate bucket command buffers!");
+            }
 
-        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE /*no fences*/) != VK_SUCCESS) {
-            throw std::runtime_error("failed to submit draw command buffer!");
+            bucketCache[i].resize(settings.cellCount);
+            for (uint32_t cell = 0; cell < settings.cellCount; cell++) {
+                bucketCache[i][cell] = {buffers[cell], 0};
+            }
         }
+    }
+
+    // everything recordDraws() would put in the command buffer of a cell. Cells with the same hash record the same commands.
+    uint64_t bucketHash(uint32_t cell) {
+        VkViewport viewport = cellViewport(cell);
+        uint64_t hash = hashBytes(&viewport, sizeof(viewport));
+        hash = hashBytes(&swapChainExtent, sizeof(swapChainExtent), hash); // the scissor
+        if (drawPath != DrawPath::Direct) {
+            hash = hashBytes(&cellFirstArg[cell], sizeof(uint32_t), hash); // where the indirect commands read
+        }
+        for (const auto& packet : cellPackets[cell]) {
+            const DrawCommand& draw = drawList[packet.drawIndex];
+            // materials can share a VkPipeline (fallback, registry, dynamic state) and still record different
+            // commands, see recordDraws(): the index picks the binding and the dynamic states, the handle changes
+            // when the pipelines are rebuilt
+            uint32_t pipeline = sortKeyPipeline(packet.key);
+            hash = hashBytes(&pipeline, sizeof(pipeline), hash);
+            hash = hashBytes(&graphicsPipelines[pipeline], sizeof(VkPipeline), hash);
+            if (dynamicRasterState || dynamicBlendState) {
+                hash = hashBytes(&materialStates[pipeline], sizeof(PipelineDesc), hash); // what the states are set to
+            }
+            hash = hashBytes(&draw, sizeof(draw), hash);
+        }
+        return hash == 0 ? 1 : hash; // 0 means never recorded
+    }
+
+    // returns the secondary command buffers of every cell for this frame slot, recording only the ones that changed
+    std::vector<VkCommandBuffer> recordDrawsCached(uint32_t frameSlot) {
+        std::vector<VkCommandBuffer> secondaries;
+        secondaries.reserve(settings.cellCount);
+        for (uint32_t cell = 0; cell < settings.cellCount; cell++) {
+            CachedBucket& bucket = bucketCache[frameSlot][cell];
+            uint64_t hash = bucketHash(cell);
+            if (hash == bucket.hash) {
+                bucketCacheHits++;
+            } else {
+                // the last frame from this slot finished, so the buffer isn't in use. Not inheriting a framebuffer
+                // lets the same buffer be used with any swap chain image, even after the swap chain is recreated.
+                VkCommandBufferInheritanceInfo inheritanceInfo{};
+                inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+                inheritanceInfo.renderPass = renderPass;
+                inheritanceInfo.subpass = 0;
+                inheritanceInfo.framebuffer = VK_NULL_HANDLE;
+
+                VkCommandBufferBeginInfo beginInfo{};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+                beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+                if (vkBeginCommandBuffer(bucket.commandBuffer, &beginInfo) != VK_SUCCESS) { // also resets it
+                    throw std::runtime_error("failed to begin recording bucket command buffer!");
+                }
+                size_t firstArg = drawPath == DrawPath::Direct ? 0 : cellFirstArg[cell];
+                recordDraws(bucket.commandBuffer, cellPackets[cell].data(), cellPackets[cell].size(), frameSlot, firstArg);
+                if (vkEndCommandBuffer(bucket.commandBuffer) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to record bucket command buffer!");
+                }
+                bucket.hash = hash;
+                bucketCacheMisses++;
+            }
+            secondaries.push_back(bucket.commandBuffer);
+        }
+        return secondaries;
+    }
+
+    void createRecordPools() {
+        if (settings.recordThreads == 0) {
+            return;
+        }
+        recordWorkers.start(settings.recordThreads);
+        if (settings.recordMode == RecordMode::CommandList) {
+            return; // the workers only record CommandLists
+        }
+
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+        recordPools.resize(settings.maxFramesInFlight);
+        recordSecondaries.resize(settings.maxFramesInFlight);
+        for (int slot = 0; slot < settings.maxFramesInFlight; slot++) {
+            recordPools[slot].resize(settings.recordThreads);
+            recordSecondaries[slot].resize(settings.recordThreads);
+            for (uint32_t worker = 0; worker < settings.recordThreads; worker++) {
+                VkCommandPool& pool = recordPools[slot][worker];
+                VkCommandPoolCreateInfo poolInfo{};
+                poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+                poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+                poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+                if (vkCreateCommandPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to create recording command pool!");
+                }
+
+                // a frame has at most recordThreads slices, see recordCommandBuffer()
+                auto& secondaries = recordSecondaries[slot][worker];
+                secondaries.resize(settings.recordThreads);
+                VkCommandBufferAllocateInfo allocInfo{};
+                allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                allocInfo.commandPool = pool;
+                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+                allocInfo.commandBufferCount = static_cast<uint32_t>(secondaries.size());
+                if (vkAllocateCommandBuffers(device, &allocInfo, secondaries.data()) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to allocate secondary command buffers!");
+                }
+            }
+        }
+    }
+
+    // Records right away into a command buffer what recordDraws() asks for. It has the same methods as CommandList,
+    // and translating a CommandList is replaying it here.
+    struct CommandBufferRecorder {
+        HelloTriangleApplication& app;
+        VkCommandBuffer commandBuffer;
+        uint32_t argSlot; // the frame slot of the indirect buffers
+
+        VkBuffer buffer(BufferId id) const {
+            switch (id) {
+                case BufferId::Index: return app.indexBuffer;
+                case BufferId::Instance: return app.instanceBuffer;
+                case BufferId::IndirectArgs: return app.indirectArgBuffers[argSlot];
+                case BufferId::IndirectCount: return app.indirectCountBuffers[argSlot];
+            }
+            return VK_NULL_HANDLE;
+        }
+
+        void bindPipeline(uint32_t pipeline) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, app.graphicsPipelines[pipeline]); // bind the graphics pipeline
+        }
+
+        void setViewport(float x, float y, float width, float height) {
+            VkViewport viewport{x, y, width, height, 0.0f, 1.0f};
+            vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+        }
+
+        void setScissor(int32_t x, int32_t y, uint32_t width, uint32_t height) {
+            VkRect2D scissor{{x, y}, {width, height}};
+            vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+        }
+
+        void bindIndexBuffer(BufferId id) {
+            vkCmdBindIndexBuffer(commandBuffer, buffer(id), 0, VK_INDEX_TYPE_UINT16);
+        }
+
+        void bindVertexBuffer(BufferId id) {
+            VkBuffer vertexBuffer = buffer(id);
+            VkDeviceSize offset = 0;
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, &offset);
+        }
+
+        void draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex, uint32_t firstInstance) {
+            // Draw command parameters
+            // vertexCount: Even though we don't have a vertex buffer, we technically still have 3 vertices to draw.
+            // instanceCount: Used for instanced rendering, use 1 if you're not doing that.
+            // firstVertex: Used as an offset into the vertex buffer, defines the lowest value of gl_VertexIndex.
+            // firstInstance: Used as an offset for instanced rendering, defines the lowest value of gl_InstanceIndex.
+            vkCmdDraw(commandBuffer, vertexCount, instanceCount, firstVertex, firstInstance);
+        }
+
+        void drawIndexedIndirect(BufferId id, uint64_t offset, uint32_t drawCount, uint32_t stride) {
+            vkCmdDrawIndexedIndirect(commandBuffer, buffer(id), offset, drawCount, stride);
+        }
+
+        void drawIndexedIndirectCount(BufferId id, uint64_t offset, BufferId countId, uint64_t countOffset,
+                                      uint32_t maxDrawCount, uint32_t stride) {
+            app.pfnCmdDrawIndexedIndirectCount(commandBuffer, buffer(id), offset, buffer(countId), countOffset, maxDrawCount, stride);
+        }
+
+        void dispatch(uint32_t x, uint32_t y, uint32_t z) {
+            vkCmdDispatch(commandBuffer, x, y, z);
+        }
+
+        void barrier(uint32_t srcStages, uint32_t dstStages, uint32_t srcAccess, uint32_t dstAccess) {
+            VkMemoryBarrier memoryBarrier{};
+            memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            memoryBarrier.srcAccessMask = srcAccess;
+            memoryBarrier.dstAccessMask = dstAccess;
+            vkCmdPipelineBarrier(commandBuffer, srcStages, dstStages, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+        }
+
+        void setRasterState(const Command::RasterState& state) {
+            app.pfnCmdSetCullModeEXT(commandBuffer, state.cullMode);
+            app.pfnCmdSetFrontFaceEXT(commandBuffer, (VkFrontFace) state.frontFace);
+            app.pfnCmdSetPrimitiveTopologyEXT(commandBuffer, (VkPrimitiveTopology) state.topology);
+        }
+
+        void setBlendState(const Command::BlendState& state) {
+            VkBool32 enable = state.enable;
+            app.pfnCmdSetColorBlendEnableEXT(commandBuffer, 0, 1, &enable); // attachment 0
+            VkColorBlendEquationEXT equation{};
+            equation.srcColorBlendFactor = (VkBlendFactor) state.srcColorFactor;
+            equation.dstColorBlendFactor = (VkBlendFactor) state.dstColorFactor;
+            equation.colorBlendOp = (VkBlendOp) state.colorOp;
+            equation.srcAlphaBlendFactor = (VkBlendFactor) state.srcAlphaFactor;
+            equation.dstAlphaBlendFactor = (VkBlendFactor) state.dstAlphaFactor;
+            equation.alphaBlendOp = (VkBlendOp) state.alphaOp;
+            app.pfnCmdSetColorBlendEquationEXT(commandBuffer, 0, 1, &equation);
+        }
+    };
+
+    void translateCommandList(const CommandList& list, VkCommandBuffer commandBuffer, uint32_t frameSlot) {
+        if (enableValidationLayers) {
+            std::string error = list.validate();
+            if (!error.empty()) {
+                throw std::runtime_error("invalid command list, " + error);
+            }
+        }
+
+        CommandBufferRecorder commandBufferRecorder{*this, commandBuffer, frameSlot};
+        StateFilter<CommandBufferRecorder> recorder(commandBufferRecorder, settings.stateFilter);
+        list.forEach([&recorder](const Command& command) {
+            switch (command.type) {
+                case CommandType::BindPipeline: recorder.bindPipeline(command.pipeline); break;
+                case CommandType::SetViewport:
+                    recorder.setViewport(command.viewport.x, command.viewport.y, command.viewport.width, command.viewport.height);
+                    break;
+                case CommandType::SetScissor:
+                    recorder.setScissor(command.scissor.x, command.scissor.y, command.scissor.width, command.scissor.height);
+                    break;
+                case CommandType::BindIndexBuffer: recorder.bindIndexBuffer(command.buffer); break;
+                case CommandType::BindVertexBuffer: recorder.bindVertexBuffer(command.buffer); break;
+                case CommandType::Draw:
+                    recorder.draw(command.draw.vertexCount, command.draw.instanceCount, command.draw.firstVertex, command.draw.firstInstance);
+                    break;
+                case CommandType::DrawIndexedIndirect:
+                    recorder.drawIndexedIndirect(command.drawIndirect.buffer, command.drawIndirect.offset,
+                                                 command.drawIndirect.maxDrawCount, command.drawIndirect.stride);
+                    break;
+                case CommandType::DrawIndexedIndirectCount:
+                    recorder.drawIndexedIndirectCount(command.drawIndirect.buffer, command.drawIndirect.offset,
+                                                      command.drawIndirect.countBuffer, command.drawIndirect.countOffset,
+                                                      command.drawIndirect.maxDrawCount, command.drawIndirect.stride);
+                    break;
+                case CommandType::Dispatch: recorder.dispatch(command.dispatch.x, command.dispatch.y, command.dispatch.z); break;
+                case CommandType::Barrier:
+                    recorder.barrier(command.barrier.srcStages, command.barrier.dstStages, command.barrier.srcAccess, command.barrier.dstAccess);
+                    break;
+                case CommandType::SetRasterState: recorder.setRasterState(command.rasterState); break;
+                case CommandType::SetBlendState: recorder.setBlendState(command.blendState); break;
+            }
+        });
+        addStateCounts(recorder);
+    }
+
+    void addStateCounts(const StateFilter<CommandBufferRecorder>& filter) {
+        stateCallsIssued += filter.issued;
+        stateCallsFiltered += filter.filtered;
+    }
+
+    // called after recording a frame
+    void sampleStateCounts() {
+        uint64_t issued = stateCallsIssued;
+        uint64_t filtered = stateCallsFiltered;
+        stateIssuedStats.add((double) (issued - sampledStateCallsIssued));
+        stateFilteredStats.add((double) (filtered - sampledStateCallsFiltered));
+        sampledStateCallsIssued = issued;
+        sampledStateCallsFiltered = filtered;
+    }
+
+    // records the draws of the packets, in their order. All state is set here because secondary command buffers
+    // don't inherit anything from the primary one. firstArg is where the indirect arguments of the first packet are.
+    void recordDraws(VkCommandBuffer commandBuffer, const DrawPacket* packets, size_t count, uint32_t frameSlot, size_t firstArg) {
+        uint32_t argSlot = settings.recordMode == RecordMode::PreRecorded ? 0 : frameSlot; // see writeIndirectArgs()
+        CommandBufferRecorder recorder{*this, commandBuffer, argSlot};
+        StateFilter<CommandBufferRecorder> filter(recorder, settings.stateFilter);
+        recordDraws(filter, packets, count, firstArg);
+        addStateCounts(filter);
+    }
+
+    // the same into a CommandList (or anything with the methods of CommandBufferRecorder). Every batch sets the
+    // pipeline and viewport it uses, redundant ones are dropped by the StateFilter in front of Vulkan.
+    // materials can share a VkPipeline (the registry, dynamic state). They bind it under the lowest index, so the
+    // state filter sees binding the same pipeline again.
+    uint32_t pipelineBinding(uint32_t pipeline) const {
+        for (uint32_t other = 0; other < pipeline; other++) {
+            if (graphicsPipelines[other] == graphicsPipelines[pipeline]) {
+                return other;
+            }
+        }
+        return pipeline;
+    }
+
+    template <typename Recorder>
+    void recordDraws(Recorder& out, const DrawPacket* packets, size_t count, size_t firstArg) {
+        // we want to draw in the entire framebuffer
+        out.setScissor(0, 0, swapChainExtent.width, swapChainExtent.height);
+
+        if (drawPath != DrawPath::Direct) {
+            out.bindIndexBuffer(BufferId::Index);
+        }
+        if (instanceBuffer != VK_NULL_HANDLE) {
+            out.bindVertexBuffer(BufferId::Instance); // firstInstance picks the range of each draw
+        }
+
+        uint64_t drawCalls = 0;
+        size_t i = 0;
+        while (i < count) {
+            const DrawCommand& draw = drawList[packets[i].drawIndex];
+            uint32_t pipeline = sortKeyPipeline(packets[i].key); // not always the draw's material, see queueDraws
+            out.bindPipeline(pipelineBinding(pipeline));
+            if (dynamicRasterState) {
+                const PipelineDesc& state = materialStates[pipeline];
+                out.setRasterState({state.cullMode, (uint32_t) state.frontFace, (uint32_t) state.topology});
+            }
+            if (dynamicBlendState) {
+                const PipelineDesc& state = materialStates[pipeline];
+                out.setBlendState({state.blendEnable, (uint32_t) state.srcColorBlendFactor, (uint32_t) state.dstColorBlendFactor,
+                                   (uint32_t) state.colorBlendOp, (uint32_t) state.srcAlphaBlendFactor,
+                                   (uint32_t) state.dstAlphaBlendFactor, (uint32_t) state.alphaBlendOp});
+            }
+            VkViewport viewport = cellViewport(draw.cell);
+            out.setViewport(viewport.x, viewport.y, viewport.width, viewport.height);
+
+            // the batch: the following draws using the same pipeline and viewport
+            size_t batchEnd = i + 1;
+            while (batchEnd < count) {
+                const DrawCommand& next = drawList[packets[batchEnd].drawIndex];
+                if (sortKeyPipeline(packets[batchEnd].key) != pipeline || next.cell != draw.cell) {
+                    break;
+                }
+                batchEnd++;
+            }
+            uint32_t batchSize = (uint32_t) (batchEnd - i);
+            uint64_t argOffset = (firstArg + i) * sizeof(VkDrawIndexedIndirectCommand);
+
+            if (drawPath == DrawPath::Indirect) {
+                out.drawIndexedIndirect(BufferId::IndirectArgs, argOffset, batchSize, sizeof(VkDrawIndexedIndirectCommand));
+                drawCalls++;
+            } else if (drawPath == DrawPath::IndirectCount) {
+                // the count in the buffer can be more than the draws left in this slice, batchSize caps it
+                out.drawIndexedIndirectCount(BufferId::IndirectArgs, argOffset, BufferId::IndirectCount,
+                                             (firstArg + i) * sizeof(uint32_t), batchSize, sizeof(VkDrawIndexedIndirectCommand));
+                drawCalls++;
+            } else {
+                for (size_t j = i; j < batchEnd; j++) {
+                    const DrawCommand& direct = drawList[packets[j].drawIndex];
+                    out.draw(direct.vertexCount, direct.instanceCount, direct.firstVertex, direct.firstInstance);
+                }
+                drawCalls += batchSize;
+            }
+            i = batchEnd;
+        }
+        recordedDraws += count;
+        recordedDrawCalls += drawCalls;
+    }
+
+    // splits the sorted draw queue in sliceCount slices recorded in parallel into secondary command buffers, returned in draw order
+    std::vector<VkCommandBuffer> recordDrawsParallel(VkFramebuffer framebuffer, uint32_t frameSlot, uint32_t sliceCount) {
+        // nothing from this slot is in use by the GPU or by the workers anymore
+        for (auto pool : recordPools[frameSlot]) {
+            vkResetCommandPool(device, pool, 0);
+        }
+
+        std::vector<VkCommandBuffer> secondaries(sliceCount, VK_NULL_HANDLE);
+        std::vector<std::string> errors(sliceCount); // a worker can't throw, what went wrong is thrown below
+        for (uint32_t slice = 0; slice < sliceCount; slice++) {
+            size_t first = drawQueue.size() * slice / sliceCount;
+            size_t last = drawQueue.size() * (slice + 1) / sliceCount;
+
+            recordWorkers.submit([this, framebuffer, frameSlot, slice, first, last, &secondaries, &errors](uint32_t worker) {
+                // from the pool only this worker uses, reset with it above
+                VkCommandBuffer secondary = recordSecondaries[frameSlot][worker][slice];
+
+                // the secondary runs inside our render pass, in this framebuffer
+                VkCommandBufferInheritanceInfo inheritanceInfo{};
+                inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+                inheritanceInfo.renderPass = renderPass;
+                inheritanceInfo.subpass = 0;
+                inheritanceInfo.framebuffer = framebuffer;
+
+                VkCommandBufferBeginInfo beginInfo{};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+                beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+                if (vkBeginCommandBuffer(secondary, &beginInfo) != VK_SUCCESS) {
+                    errors[slice] = "failed to begin recording secondary command buffer!";
+                    return;
+                }
+                try {
+                    recordDraws(secondary, drawQueue.sorted().data() + first, last - first, frameSlot, first);
+                } catch (const std::exception& e) {
+                    errors[slice] = e.what();
+                    return;
+                }
+                if (vkEndCommandBuffer(secondary) != VK_SUCCESS) {
+                    errors[slice] = "failed to record secondary command buffer!";
+                    return;
+                }
+                secondaries[slice] = secondary;
+            });
+        }
+        recordWorkers.waitIdle();
+
+        for (const auto& error : errors) {
+            if (!error.empty()) {
+                throw std::runtime_error(error);
+            }
+        }
+        return secondaries;
+    }
+
+    // records the sorted draw queue into commandLists, split in sliceCount slices recorded by the workers, or one
+    // list recorded here when sliceCount is 0. No Vulkan call is made.
+    void recordCommandLists(uint32_t frameSlot, uint32_t sliceCount) {
+        FrameArena& arena = *frameArenas[frameSlot];
+        commandLists.resize(std::max(1u, sliceCount));
+        do {
+            // the last frame from this slot finished, or the arena was too small and the lists are recorded again
+            arena.reset();
+            if (sliceCount == 0) {
+                commandLists[0].begin(arena);
+                recordDraws(commandLists[0], drawQueue.sorted().data(), drawQueue.size(), 0);
+                continue;
+            }
+            for (uint32_t slice = 0; slice < sliceCount; slice++) {
+                size_t first = drawQueue.size() * slice / sliceCount;
+                size_t last = drawQueue.size() * (slice + 1) / sliceCount;
+                recordWorkers.submit([this, &arena, slice, first, last](uint32_t) {
+                    commandLists[slice].begin(arena);
+                    recordDraws(commandLists[slice], drawQueue.sorted().data() + first, last - first, first);
+                });
+            }
+            recordWorkers.waitIdle();
+        } while (arena.overflowed());
+    }
+
+    // records the drawing of the scene, as it is in renderState, into the framebuffer of a swap chain image
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, size_t imageIndex) {
+        recordCommandBuffer(commandBuffer, imageIndex, (uint32_t) currentFrame, settings.recordThreads);
+    }
+
+    // recordThreads 0 records everything inline in the primary command buffer
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, size_t imageIndex, uint32_t frameSlot, uint32_t recordThreads) {
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = 0; // no flag (Optional)
+        beginInfo.pInheritanceInfo = nullptr; // Optional
+
+        // begin recording command buffer
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording command buffer!");
+        }
+
+        VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
+        VkRenderPassBeginInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = swapChainExtent;
+        renderPassInfo.clearValueCount = 1;         //  define the clear values to use for VK_ATTACHMENT_LOAD_OP_CLEAR,
+        renderPassInfo.pClearValues = &clearColor;  // which we used as load operation for the color attachment
+        if (settings.recordMode == RecordMode::CommandList) {
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+            double start = glfwGetTime();
+            recordCommandLists(frameSlot, recordThreads);
+            commandListStats.add((glfwGetTime() - start) * 1000.0);
+            for (const auto& list : commandLists) {
+                translateCommandList(list, commandBuffer, frameSlot);
+            }
+        } else if (settings.recordMode == RecordMode::Cached) {
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            auto secondaries = recordDrawsCached(frameSlot);
+            vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(secondaries.size()), secondaries.data());
+        } else if (recordThreads > 0) {
+            // the render pass contents come from the secondary command buffers only
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            auto secondaries = recordDrawsParallel(swapChainFramebuffers[imageIndex], frameSlot, recordThreads);
+            vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(secondaries.size()), secondaries.data());
+        } else {
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE); // returns void, no error handling until finish
+            recordDraws(commandBuffer, drawQueue.sorted().data(), drawQueue.size(), frameSlot, 0);
+        }
+
+        vkCmdEndRenderPass(commandBuffer); // ends the render pass
+
+        if(vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record command buffer!");
+        }
+    }
+
+    void createSyncObjects() {
+        imageAvailableSemaphores.resize(settings.maxFramesInFlight);
+        renderFinishedSemaphores.resize(settings.maxFramesInFlight);
+        frameSlotValues.resize(settings.maxFramesInFlight, 0);
+        imagesInFlight.resize(swapChainImages.size(), 0); // no frame is using an image yet
+        imagePresentFrameStart.resize(swapChainImages.size(), 0.0);
+
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+        for (int i = 0; i < settings.maxFramesInFlight; i++) {
+            if(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
+               vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create synchronization objects for a frame!");
+            }
+        }
+
+        if (timelineSemaphoreEnabled) {
+            VkSemaphoreTypeCreateInfo timelineInfo{};
+            timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+            timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+            timelineInfo.initialValue = 0; // nothing submitted yet
+
+            VkSemaphoreCreateInfo timelineSemaphoreInfo{};
+            timelineSemaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            timelineSemaphoreInfo.pNext = &timelineInfo;
+            if (vkCreateSemaphore(device, &timelineSemaphoreInfo, nullptr, &frameTimeline) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create timeline semaphore!");
+            }
+        } else {
+            inFlightFences.resize(settings.maxFramesInFlight);
+
+            VkFenceCreateInfo fenceInfo{};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT; // so the first wait on each slot returns immediately
+
+            for (int i = 0; i < settings.maxFramesInFlight; i++) {
+                if (vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to create synchronization objects for a frame!");
+                }
+            }
+        }
+    }
+
+    // returns the highest submission value the GPU has finished, without blocking
+    uint64_t completedSubmissionValue() {
+        if (timelineSemaphoreEnabled) {
+            pfnGetSemaphoreCounterValue(device, frameTimeline, &lastCompletedValue);
+        } else {
+            // a single queue finishes submissions in order, so the newest signaled fence tells how far the GPU got.
+            // Fences of frames the submission thread didn't submit yet are left alone, it may be using them.
+            for (size_t i = 0; i < inFlightFences.size(); i++) {
+                if (frameSlotValues[i] > lastCompletedValue && frameSlotValues[i] <= submittedValue &&
+                    vkGetFenceStatus(device, inFlightFences[i]) == VK_SUCCESS) {
+                    lastCompletedValue = frameSlotValues[i];
+                }
+            }
+        }
+        return lastCompletedValue;
+    }
+
+    // blocks until the GPU finished the submission with this value (and all previous ones)
+    void waitForSubmissionValue(uint64_t value) {
+        if (value <= lastCompletedValue) {
+            return;
+        }
+        waitUntilSubmitted(value); // waiting on a semaphore or fence that wasn't submitted yet could hang
+
+        if (timelineSemaphoreEnabled) {
+            VkSemaphoreWaitInfo waitInfo{};
+            waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+            waitInfo.semaphoreCount = 1;
+            waitInfo.pSemaphores = &frameTimeline;
+            waitInfo.pValues = &value;
+            pfnWaitSemaphores(device, &waitInfo, UINT64_MAX);
+        } else {
+            for (size_t i = 0; i < inFlightFences.size(); i++) {
+                if (frameSlotValues[i] > lastCompletedValue && frameSlotValues[i] <= value) {
+                    vkWaitForFences(device, 1, &inFlightFences[i], VK_TRUE, UINT64_MAX);
+                }
+            }
+        }
+        lastCompletedValue = value;
+    }
+
+    // hands the frame over for submission and presentation, and returns its submission value. The value and the
+    // slot's fence are taken care of here, so the renderer can wait on the value right away.
+    uint64_t queueFrame(FrameSubmission frame) {
+        frame.value = ++lastSubmittedValue;
+        frame.frameSlot = currentFrame;
+        frameSlotValues[currentFrame] = frame.value;
+        if (!timelineSemaphoreEnabled) {
+            // reset right before use, we waited for it before reusing this slot. The submission thread never
+            // resets fences, so only this thread changes them while they aren't submitted.
+            vkResetFences(device, 1, &inFlightFences[currentFrame]);
+        }
+        if (!presentWaitEnabled) {
+            imagePresentFrameStart[frame.imageIndex] = frame.frameStart;
+        }
+
+        if (!settings.submitThread) {
+            std::vector<FrameSubmission> frames;
+            frames.push_back(std::move(frame));
+            submitFrames(frames);
+            return lastSubmittedValue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(submitMutex);
+            if (!submitThreadError.empty()) {
+                throw std::runtime_error(submitThreadError);
+            }
+            submitQueueDepthStats.add((double) submitQueue.size());
+            submitQueue.push_back(std::move(frame));
+        }
+        submitCondition.notify_one();
+        return lastSubmittedValue;
+    }
+
+    // submits the batches of these frames with as few vkQueueSubmit calls as possible, then presents them in order.
+    // With the timeline semaphore each frame's last batch says which value it signals, so everything goes in one
+    // call. Fences can only be given per call, so without it that's one call per frame.
+    void submitFrames(std::vector<FrameSubmission>& frames) {
+        size_t batchCount = 0;
+        for (const auto& frame : frames) {
+            batchCount += frame.batches.size();
+        }
+
+        // reserved up front, the submit infos point into these
+        std::vector<VkSubmitInfo> submitInfos;
+        std::vector<VkTimelineSemaphoreSubmitInfo> timelineSubmitInfos;
+        std::vector<std::vector<VkSemaphore>> signalSemaphores;
+        std::vector<std::vector<uint64_t>> signalValues;
+        submitInfos.reserve(batchCount);
+        timelineSubmitInfos.reserve(batchCount);
+        signalSemaphores.reserve(batchCount);
+        signalValues.reserve(batchCount);
+
+        uint32_t submitCalls = 0;
+        double submitStart = glfwGetTime();
+        for (auto& frame : frames) {
+            for (size_t i = 0; i < frame.batches.size(); i++) {
+                const SubmitBatch& batch = frame.batches[i];
+                signalSemaphores.push_back(batch.signalSemaphores);
+                signalValues.emplace_back(batch.signalSemaphores.size(), 0); // values of binary semaphores are ignored
+                if (timelineSemaphoreEnabled && i + 1 == frame.batches.size()) {
+                    signalSemaphores.back().push_back(frameTimeline);
+                    signalValues.back().push_back(frame.value);
+                }
+
+                VkSubmitInfo submitInfo{};
+                submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                submitInfo.waitSemaphoreCount = static_cast<uint32_t>(batch.waitSemaphores.size());
+                submitInfo.pWaitSemaphores = batch.waitSemaphores.data();
+                submitInfo.pWaitDstStageMask = batch.waitStages.data();
+                submitInfo.commandBufferCount = static_cast<uint32_t>(batch.commandBuffers.size());
+                submitInfo.pCommandBuffers = batch.commandBuffers.data();
+                submitInfo.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.back().size());
+                submitInfo.pSignalSemaphores = signalSemaphores.back().data();
+                if (timelineSemaphoreEnabled) {
+                    VkTimelineSemaphoreSubmitInfo timelineSubmitInfo{};
+                    timelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+                    timelineSubmitInfo.signalSemaphoreValueCount = static_cast<uint32_t>(signalValues.back().size());
+                    timelineSubmitInfo.pSignalSemaphoreValues = signalValues.back().data();
+                    timelineSubmitInfos.push_back(timelineSubmitInfo);
+                    submitInfo.pNext = &timelineSubmitInfos.back();
+                }
+                submitInfos.push_back(submitInfo);
+            }
+
+            if (!timelineSemaphoreEnabled) {
+                if (vkQueueSubmit(graphicsQueue, static_cast<uint32_t>(submitInfos.size()), submitInfos.data(),
+                                  inFlightFences[frame.frameSlot]) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to submit draw command buffer!");
+                }
+                submitInfos.clear();
+                submitCalls++;
+            }
+        }
+        if (!submitInfos.empty()) {
+            if (vkQueueSubmit(graphicsQueue, static_cast<uint32_t>(submitInfos.size()), submitInfos.data(), VK_NULL_HANDLE) != VK_SUCCESS) {
+                throw std::runtime_error("failed to submit draw command buffer!");
+            }
+            submitCalls++;
+        }
+        submitCallStats.add((glfwGetTime() - submitStart) * 1000.0 / submitCalls);
+        framesPerSubmitStats.add((double) frames.size() / submitCalls);
+
+        for (const auto& frame : frames) {
+            presentFrame(frame);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(submitMutex);
+            submittedValue = frames.back().value;
+        }
+        submittedCondition.notify_all();
+    }
+
+    void presentFrame(const FrameSubmission& frame) {
+        VkPresentInfoKHR presentInfo{};
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.waitSemaphoreCount = static_cast<uint32_t>(frame.batches.back().signalSemaphores.size());
+        presentInfo.pWaitSemaphores = frame.batches.back().signalSemaphores.data(); // which semaphores to wait on before presentation can happen
 
-        VkPresentInfoKHR presentInfo{};
-        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-        presentInfo.waitSemaphoreCount = 1;
-        presentInfo.pWaitSemaphores = signalSemaphores; // which semaphores to wait on before presentation can happen
-
-        VkSwapchainKHR swapChains[] = {swapChain};
         presentInfo.swapchainCount = 1;
-        presentInfo.pSwapchains = swapChains;
-        presentInfo.pImageIndices = &imageIndex;
+        presentInfo.pSwapchains = &frame.swapChain;
+        presentInfo.pImageIndices = &frame.imageIndex;
         presentInfo.pResults = nullptr; // Optional - array of VkResult values to check for every individual swap chain if presentation was successful
 
-        vkQueuePresentKHR(presentQueue, &presentInfo);
+        VkResult result;
+        double presentStart = glfwGetTime();
+        {
+            std::lock_guard<std::mutex> swapChainLock(swapChainMutex);
+            if (presentWaitEnabled) {
+                uint64_t presentId = nextPresentId++;
+                VkPresentIdKHR presentIdInfo{};
+                presentIdInfo.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+                presentIdInfo.swapchainCount = 1;
+                presentIdInfo.pPresentIds = &presentId;
+                presentInfo.pNext = &presentIdInfo;
+
+                {
+                    std::lock_guard<std::mutex> lock(presentWaitMutex);
+                    result = vkQueuePresentKHR(presentQueue, &presentInfo);
+                    if (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR) {
+                        pendingPresents.push_back({frame.swapChain, presentId, frame.frameStart});
+                    }
+                }
+                presentWaitCondition.notify_one();
+            } else {
+                result = vkQueuePresentKHR(presentQueue, &presentInfo);
+            }
+        }
+        presentCallStats.add((glfwGetTime() - presentStart) * 1000.0);
+
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+            presentOutOfDate = true; // the renderer recreates the swap chain before its next frame
+        } else if (result != VK_SUCCESS) {
+            throw std::runtime_error("failed to present swap chain image!");
+        }
+    }
+
+    // submission thread, see --submit-thread. Takes every frame waiting at once, so frames that piled up while
+    // the last vkQueueSubmit or present blocked are submitted together.
+    void submitLoop() {
+        std::unique_lock<std::mutex> lock(submitMutex);
+        while (true) {
+            submitCondition.wait(lock, [this] { return submitThreadStop || !submitQueue.empty(); });
+            if (submitQueue.empty()) {
+                return; // stopping, and everything queued was submitted
+            }
+
+            std::vector<FrameSubmission> frames(std::make_move_iterator(submitQueue.begin()),
+                                                std::make_move_iterator(submitQueue.end()));
+            submitQueue.clear();
+            lock.unlock();
+            try {
+                submitFrames(frames);
+            } catch (const std::exception& e) {
+                lock.lock();
+                submitThreadError = e.what();
+                submittedCondition.notify_all();
+                return;
+            }
+            lock.lock();
+        }
+    }
+
+    void startSubmitThread() {
+        if (settings.submitThread) {
+            submitThread = std::thread(&HelloTriangleApplication::submitLoop, this);
+        }
+    }
+
+    // submits everything still queued and waits for the thread to finish
+    void stopSubmitThread() {
+        if (!submitThread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(submitMutex);
+            submitThreadStop = true;
+        }
+        submitCondition.notify_one();
+        submitThread.join();
+    }
+
+    // blocks until the frame with this value was handed to Vulkan. Does nothing without a submission thread,
+    // frames are submitted as soon as they are queued then.
+    void waitUntilSubmitted(uint64_t value) {
+        if (submittedValue >= value) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(submitMutex);
+        submittedCondition.wait(lock, [&] { return submittedValue >= value || !submitThreadError.empty(); });
+        if (!submitThreadError.empty()) {
+            throw std::runtime_error(submitThreadError);
+        }
+    }
+
+    // acquires the next image of the swap chain. With a submission thread or the present wait thread the swap chain
+    // is shared, and a blocking acquire holding the lock could wait for a present that waits for the lock (or hold
+    // back the present wait thread and inflate the latencies it measures), so we poll instead.
+    VkResult acquireNextImage(uint32_t* imageIndex) {
+        if (!settings.submitThread && !presentWaitEnabled) {
+            std::lock_guard<std::mutex> lock(swapChainMutex);
+            return vkAcquireNextImageKHR(device, swapChain, UINT64_MAX /*disable timeout*/,
+                    imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, imageIndex);
+        }
+
+        while (true) {
+            VkResult result;
+            {
+                std::lock_guard<std::mutex> lock(swapChainMutex);
+                result = vkAcquireNextImageKHR(device, swapChain, 0, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, imageIndex);
+            }
+            if (result != VK_NOT_READY && result != VK_TIMEOUT) {
+                return result;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    bool renderingSuspended() {
+        return windowIconified || framebufferWidth == 0 || framebufferHeight == 0 ||
+               (settings.suspendWhenUnfocused && !windowFocused);
+    }
+
+    // main thread, after changing anything renderingSuspended() looks at. Taking the lock makes sure a render thread
+    // that just checked the old state is already waiting when we notify.
+    void notifyVisibilityChanged() {
+        { std::lock_guard<std::mutex> lock(suspendMutex); }
+        suspendCondition.notify_all();
+    }
+
+    // renderer side. Blocks while there's nothing visible, then resumes with a new swap chain
+    void waitWhileSuspended() {
+        if (!renderingSuspended()) {
+            return;
+        }
+
+        double start = glfwGetTime();
+        if (settings.renderThread) {
+            std::unique_lock<std::mutex> lock(suspendMutex);
+            suspendCondition.wait(lock, [this] { return !rendering || !renderingSuspended(); });
+        } else {
+            while (rendering && renderingSuspended() && !glfwWindowShouldClose(window)) {
+                glfwWaitEvents();
+            }
+        }
+
+        suspendCount++;
+        suspendedTime += glfwGetTime() - start;
+        swapChainNeedsRecreate = true; // the window probably changed while we weren't looking
+        lastFrameTime = 0.0; // the pause is not a frame
+        framePacer.reset();
+    }
+
+    static void windowIconifyCallback(GLFWwindow* window, int iconified) {
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+        app->windowIconified = iconified == GLFW_TRUE;
+        app->notifyVisibilityChanged();
+    }
+
+    static void windowFocusCallback(GLFWwindow* window, int focused) {
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+        app->windowFocused = focused == GLFW_TRUE;
+        app->notifyVisibilityChanged();
+    }
+
+    // main thread only. Real events can't be lost, but waiting for the renderer to make room could wait forever
+    // (it may be suspended until the next callback), so what doesn't fit goes to eventOverflow.
+    void postEvent(const AppEvent& event) {
+        // only this thread sets the flag, so while it's clear nothing older waits in eventOverflow
+        if (!eventOverflowPending.load(std::memory_order_acquire) && eventQueue.push(event)) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(eventOverflowMutex);
+        eventsOverflowed++;
+        if (event.type == AppEvent::FramebufferResize && !eventOverflow.empty() &&
+                eventOverflow.back().type == AppEvent::FramebufferResize) {
+            eventOverflow.back() = event; // only the last size matters
+        } else {
+            eventOverflow.push_back(event);
+        }
+        eventOverflowPending.store(true, std::memory_order_release);
+    }
+
+    static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+        app->framebufferWidth = width;
+        app->framebufferHeight = height;
+        app->notifyVisibilityChanged();
+
+        AppEvent event{AppEvent::FramebufferResize};
+        event.width = width;
+        event.height = height;
+        app->postEvent(event);
+    }
+
+    static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+
+        AppEvent event{AppEvent::Key};
+        event.key = key;
+        event.action = action;
+        app->postEvent(event);
+    }
+
+    // main thread. Simulates a burst of expensive events (think window moves or input floods) every 100ms,
+    // each one costs some CPU time to handle before being forwarded to the renderer.
+    void generateEventStorm() {
+        const double stormInterval = 0.1;
+        const double eventCost = 0.00002; // 20 microseconds per event
+
+        if (settings.eventStormSize == 0 || glfwGetTime() - lastEventStorm < stormInterval) {
+            return;
+        }
+        lastEventStorm = glfwGetTime();
+
+        for (uint32_t i = 0; i < settings.eventStormSize; i++) {
+            double eventStart = glfwGetTime();
+            while (glfwGetTime() - eventStart < eventCost) {
+                // pretend to translate the event
+            }
+
+            syntheticEventsGenerated++;
+            if (!eventQueue.push(AppEvent{AppEvent::Synthetic})) {
+                syntheticEventsDropped++; // fake events are allowed to get lost
+            }
+        }
+    }
+
+    // renderer side, applies everything the main thread sent since the last frame
+    void processEvents() {
+        AppEvent event;
+        while (eventQueue.pop(event)) {
+            processEvent(event);
+        }
+
+        if (!eventOverflowPending.load(std::memory_order_acquire)) {
+            return;
+        }
+
+        // postEvent doesn't push to the queue while the flag is set, so the real events left in it are older than
+        // the overflow. Both are moved out under the lock and handled after, the main thread never waits for that.
+        std::vector<AppEvent> pending;
+        {
+            std::lock_guard<std::mutex> lock(eventOverflowMutex);
+            while (eventQueue.pop(event)) {
+                pending.push_back(event);
+            }
+            pending.insert(pending.end(), eventOverflow.begin(), eventOverflow.end());
+            eventOverflow.clear();
+            eventOverflowPending.store(false, std::memory_order_release);
+        }
+        for (const auto& pendingEvent : pending) {
+            processEvent(pendingEvent);
+        }
+    }
+
+    void processEvent(const AppEvent& event) {
+        switch (event.type) {
+            case AppEvent::Key:
+                if (event.action == GLFW_PRESS && event.key >= GLFW_KEY_1 && event.key < GLFW_KEY_1 + (int) PresentPolicy::Count) {
+                    setPresentPolicy((PresentPolicy) (event.key - GLFW_KEY_1));
+                } else if (event.action == GLFW_PRESS && event.key == GLFW_KEY_R) {
+                    pipelineReloadRequested = true; // applied at the start of the next frame
+                }
+                break;
+            case AppEvent::FramebufferResize:
+                swapChainNeedsRecreate = true;
+                break;
+            case AppEvent::Synthetic:
+                syntheticEventsProcessed++;
+                break;
+        }
+    }
+
+    // the present mode is fixed at swap chain creation, so switching policy means recreating the swap chain
+    void setPresentPolicy(PresentPolicy policy) {
+        if (policy == settings.presentPolicy) {
+            return;
+        }
+        settings.presentPolicy = policy;
+        swapChainNeedsRecreate = true;
+        if (settings.swapChainImages == 0) {
+            depthTuner.reset(0); // the best depth depends on the present mode, tune again
+        }
+        std::cout << "present policy: " << presentPolicyName(policy) << std::endl;
+    }
+
+    // Builds a new swap chain for the current window size. The render pass and the pipeline don't depend on the
+    // size (viewport and scissor are dynamic) so they are kept, the surface format stays the same for the same surface.
+    // Returns false when the window has no area (minimized), in that case there's nothing to draw to.
+    bool recreateSwapChain() {
+        if (framebufferWidth == 0 || framebufferHeight == 0) {
+            return false;
+        }
+
+        double start = glfwGetTime();
+
+        // the submission thread must be done presenting to the old swap chain
+        waitUntilSubmitted(lastSubmittedValue);
+
+        // frames already submitted may still use these, the new swap chain is created while they finish
+        VkSwapchainKHR oldSwapChain = swapChain;
+        std::vector<VkImageView> oldImageViews = std::move(swapChainImageViews);
+        std::vector<VkFramebuffer> oldFramebuffers = std::move(swapChainFramebuffers);
+        std::vector<VkCommandBuffer> oldCommandBuffers = std::move(commandBuffers);
+        swapChainImageViews.clear(); // moved from, now surely empty
+        swapChainFramebuffers.clear();
+        commandBuffers.clear();
+
+        createSwapChain(); // uses the old swapChain as oldSwapchain
+        createImageViews();
+        createFramebuffers();
+        createCommandBuffers();
+        imagesInFlight.assign(swapChainImages.size(), 0); // new images, nothing rendered to them yet
+        imagePresentFrameStart.assign(swapChainImages.size(), 0.0);
+
+        deferDestroy([this, oldSwapChain, oldImageViews, oldFramebuffers, oldCommandBuffers] {
+            std::lock_guard<std::mutex> swapChainLock(swapChainMutex);
+            if (presentWaitEnabled) {
+                // the waiting thread must not touch this swap chain anymore, it checks under swapChainMutex
+                std::lock_guard<std::mutex> lock(presentWaitMutex);
+                pendingPresents.erase(std::remove_if(pendingPresents.begin(), pendingPresents.end(),
+                        [&](const PendingPresent& pending) { return pending.swapChain == oldSwapChain; }),
+                        pendingPresents.end());
+            }
+
+            if (!oldCommandBuffers.empty()) {
+                vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(oldCommandBuffers.size()), oldCommandBuffers.data());
+            }
+            for (auto framebuffer : oldFramebuffers) {
+                vkDestroyFramebuffer(device, framebuffer, nullptr);
+            }
+            for (auto imageView : oldImageViews) {
+                vkDestroyImageView(device, imageView, nullptr);
+            }
+            vkDestroySwapchainKHR(device, oldSwapChain, nullptr);
+        });
+        swapChainNeedsRecreate = false;
+        swapChainRecreateCount++;
+        swapChainRecreateStats.add((glfwGetTime() - start) * 1000.0);
+        return true;
+    }
+
+    // background thread, see presentWaitEnabled
+    void presentWaitLoop() {
+        std::unique_lock<std::mutex> lock(presentWaitMutex);
+        while (true) {
+            presentWaitCondition.wait(lock, [this] { return presentWaitStop || !pendingPresents.empty(); });
+            if (presentWaitStop) {
+                return;
+            }
+
+            PendingPresent pending = pendingPresents.front();
+            lock.unlock();
+            VkResult result;
+            {
+                // swapChainMutex comes first, and the swap chain may have been retired while neither was held
+                std::lock_guard<std::mutex> swapChainLock(swapChainMutex);
+                lock.lock();
+                if (pendingPresents.empty() || pendingPresents.front().presentId != pending.presentId) {
+                    continue; // dropped with its swap chain
+                }
+                lock.unlock();
+                result = pfnWaitForPresentKHR(device, pending.swapChain, pending.presentId, 0);
+                lock.lock();
+                if (result != VK_TIMEOUT) {
+                    pendingPresents.pop_front(); // still the front, retiring the swap chain needs swapChainMutex
+                }
+            }
+            if (result == VK_TIMEOUT) {
+                // not on screen yet, let the renderer use the swap chain meanwhile
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::microseconds(250));
+                lock.lock();
+                continue;
+            }
+
+            if (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR) {
+                displayLatencies.push_back((glfwGetTime() - pending.frameStart) * 1000.0);
+            }
+            // anything else (out of date, surface lost) means the frame will never be shown
+        }
+    }
+
+    void startPresentWaitThread() {
+        if (presentWaitEnabled) {
+            presentWaitThread = std::thread(&HelloTriangleApplication::presentWaitLoop, this);
+        }
+    }
+
+    void stopPresentWaitThread() {
+        if (!presentWaitThread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(presentWaitMutex);
+            presentWaitStop = true;
+        }
+        presentWaitCondition.notify_one();
+        presentWaitThread.join();
+    }
+
+    // queues destroy to run once every frame submitted so far finished on the GPU
+    void deferDestroy(std::function<void()> destroy) {
+        deletionQueue.push_back({lastSubmittedValue, std::move(destroy)});
+        deferredDeletionCount++;
+        deletionQueuePeak = std::max(deletionQueuePeak, deletionQueue.size());
+    }
+
+    // runs the deferred destructions the GPU is done with, called once per frame. With everything = true runs all
+    // of them, the caller made sure the device is idle.
+    void releaseDeferredDeletions(bool everything = false) {
+        if (deletionQueue.empty()) {
+            return;
+        }
+
+        uint64_t completed = everything ? UINT64_MAX : completedSubmissionValue();
+        while (!deletionQueue.empty() && deletionQueue.front().value <= completed) {
+            deletionQueue.front().destroy();
+            deletionQueue.pop_front();
+        }
+    }
+
+    // the pre-recorded command buffers may be pending, so they are replaced by new ones instead of being reset
+    void recreatePreRecordedCommandBuffers() {
+        std::vector<VkCommandBuffer> oldCommandBuffers = std::move(commandBuffers);
+        commandBuffers.clear();
+        deferDestroy([this, oldCommandBuffers] {
+            vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(oldCommandBuffers.size()), oldCommandBuffers.data());
+        });
+        createCommandBuffers();
+    }
+
+    // builds the pipelines again from the shader files, while frames using the old ones may still be in flight.
+    // Pre-recorded command buffers bind the old pipelines, so they are recorded again into new ones. Cached cells
+    // hash the pipeline handles and notice by themselves, the other modes record every frame anyway.
+    void reloadPipelines() {
+        double start = glfwGetTime();
+        std::vector<VkPipeline> oldPipelines = graphicsPipelines;
+        createGraphicsPipeline();
+        deferDestroy([this, oldPipelines] {
+            for (auto pipeline : oldPipelines) {
+                pipelineRegistry.release(device, pipeline); // unchanged shaders give the same pipelines, still in use
+            }
+        });
+
+        if (settings.recordMode == RecordMode::PreRecorded) {
+            recreatePreRecordedCommandBuffers();
+        }
+
+        pipelineReloadRequested = false;
+        lastPipelineReloadFrame = frameCount;
+        pipelineReloadStats.add((glfwGetTime() - start) * 1000.0);
+    }
+
+    void drawFrame() {
+        double frameStart = glfwGetTime();
+        lastFrameDuration = 0.0;
+        if (lastFrameTime > 0.0) {
+            lastFrameDuration = (frameStart - lastFrameTime) * 1000.0;
+            frameTimeStats.add(lastFrameDuration);
+            presentPolicyStats[(int) settings.presentPolicy].frameTime.add(lastFrameDuration);
+        }
+        lastFrameTime = frameStart;
+
+        releaseDeferredDeletions();
+        if (presentOutOfDate.exchange(false)) {
+            swapChainNeedsRecreate = true; // reported by the submission thread
+        }
+        if (swapChainNeedsRecreate && !recreateSwapChain()) {
+            return; // minimized, nothing to draw
+        }
+        if (settings.pipelineReloadFrames > 0 && frameCount - lastPipelineReloadFrame >= settings.pipelineReloadFrames) {
+            pipelineReloadRequested = true;
+        }
+        if (pipelineReloadRequested) {
+            reloadPipelines();
+        }
+        collectCompiledPipelines();
+        if (settings.pipelineCacheSaveSeconds > 0.0 && frameStart - lastPipelineCacheSave > settings.pipelineCacheSaveSeconds) {
+            savePipelineCache();
+        }
+
+        // wait only for the frame that used this slot maxFramesInFlight frames ago
+        double waitStart = glfwGetTime();
+        waitForSubmissionValue(frameSlotValues[currentFrame]);
+
+        uint32_t imageIndex;
+
+        // acquire the image from the swapchain
+        double acquireStart = glfwGetTime();
+        VkResult result = acquireNextImage(&imageIndex);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            // the swap chain can't be used anymore (usually after a resize), nothing was acquired so no semaphore
+            // got signaled, we try again with a new swap chain on the next frame
+            swapChainNeedsRecreate = true;
+            return;
+        } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) { // suboptimal still presents fine, we recreate after presenting
+            throw std::runtime_error("failed to acquire swap chain image!");
+        }
+        double acquireWait = (glfwGetTime() - acquireStart) * 1000.0;
+        acquireWaitStats.add(acquireWait);
+        if (!presentWaitEnabled && imagePresentFrameStart[imageIndex] > 0.0) {
+            displayLatencies.push_back((glfwGetTime() - imagePresentFrameStart[imageIndex]) * 1000.0);
+        }
+        if (settings.swapChainImages == 0 && lastFrameDuration > 0.0 &&
+            depthTuner.addFrame(lastFrameDuration, acquireWait, swapChainMaxImageCount)) {
+            swapChainNeedsRecreate = true; // applied after presenting this frame
+        }
+
+        // the swap chain may hand us images out of order, or have fewer images than frames in flight,
+        // so an older frame could still be rendering to this image.
+        waitForSubmissionValue(imagesInFlight[imageIndex]);
+        fenceWaitStats.add((glfwGetTime() - waitStart) * 1000.0);
+
+        VkCommandBuffer commandBuffer;
+        if (settings.recordMode != RecordMode::PreRecorded) {
+            // we waited for the last frame submitted from this slot, so nothing in its pool is in use anymore
+            queueDraws((uint32_t) currentFrame);
+            double recordStart = glfwGetTime();
+            vkResetCommandPool(device, frameCommandPools[currentFrame], 0);
+            commandBuffer = frameCommandBuffers[currentFrame];
+            recordCommandBuffer(commandBuffer, imageIndex);
+            recordStats.add((glfwGetTime() - recordStart) * 1000.0);
+            sampleStateCounts();
+        } else {
+            commandBuffer = commandBuffers[imageIndex];
+            if (settings.simulationHz > 0.0) {
+                // the scene moves, so the pre-recorded command buffer of this image is outdated. We waited for the
+                // last frame that used this image, so it's safe to record it again.
+                queueDraws((uint32_t) currentFrame);
+                double recordStart = glfwGetTime();
+                vkResetCommandBuffer(commandBuffer, 0);
+                recordCommandBuffer(commandBuffer, imageIndex);
+                recordStats.add((glfwGetTime() - recordStart) * 1000.0);
+                sampleStateCounts();
+            }
+        }
+
+        SubmitBatch batch;
+        batch.waitSemaphores = {imageAvailableSemaphores[currentFrame]}; // which semaphores to wait on before execution begins
+        batch.waitStages = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT}; // which stage(s) of the pipeline to wait
+        batch.commandBuffers = {commandBuffer}; // which command buffers to submit for execution
+        batch.signalSemaphores = {renderFinishedSemaphores[currentFrame]}; // which semaphores to signal once the command buffer(s) have finished execution
+
+        FrameSubmission frame{};
+        frame.batches.push_back(std::move(batch));
+        frame.swapChain = swapChain;
+        frame.imageIndex = imageIndex;
+        frame.frameStart = frameStart;
+        imagesInFlight[imageIndex] = queueFrame(std::move(frame)); // this image is now used by this frame
+
+        // with a submission thread this ends when the frame is handed over, not presented
+        presentPolicyStats[(int) settings.presentPolicy].acquireToPresent.add((glfwGetTime() - acquireStart) * 1000.0);
+        if (presentOutOfDate.exchange(false)) {
+            swapChainNeedsRecreate = true;
+        }
+
+        currentFrame = (currentFrame + 1) % settings.maxFramesInFlight;
+        frameCount++;
     }
 
     // main functions at top level
@@ -930,9 +4277,19 @@ private:
         glfwInit();
 
         glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
         window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
+        glfwSetWindowUserPointer(window, this); // so static callbacks can find the app
+        glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+        glfwSetKeyCallback(window, keyCallback);
+        glfwSetWindowIconifyCallback(window, windowIconifyCallback);
+        glfwSetWindowFocusCallback(window, windowFocusCallback);
+
+        int width, height;
+        glfwGetFramebufferSize(window, &width, &height);
+        framebufferWidth = width;
+        framebufferHeight = height;
     }
 
     void initVulkan() {
@@ -944,29 +4301,461 @@ private:
         createSwapChain(); // presentation
         createImageViews(); // presentation
         createRenderPass(); // graphics pipeline
+        createPipelineCache(); // graphics pipeline
+        createPipelineLayout(); // graphics pipeline
+        double pipelineStart = glfwGetTime();
         createGraphicsPipeline(); // graphics pipeline
+        startupPipelineTime = (glfwGetTime() - pipelineStart) * 1000.0; // cold vs warm cache
         createFramebuffers(); // drawing
         createCommandPool(); // drawing
+        buildScene(); // drawing
+        createIndirectBuffers(); // drawing
+        createInstanceBuffer(); // drawing
         createCommandBuffers(); // drawing
-        createSemaphores(); // drawing
+        createFrameCommandPools(); // drawing
+        createRecordPools(); // drawing
+        createBucketCache(); // drawing
+        createSyncObjects(); // drawing
+        startPresentWaitThread(); // measuring
+        startSubmitThread(); // drawing
     }
 
     void mainLoop() {
-        while (!glfwWindowShouldClose(window)) {
-            glfwPollEvents();
-            drawFrame();
+        if (settings.targetFps > 0.0) {
+            framePacer.targetFrameTime = 1.0 / settings.targetFps;
+        }
+
+        rendering = true;
+        if (settings.renderThread) {
+            std::thread renderThread(&HelloTriangleApplication::renderLoop, this);
+
+            // the main thread just waits for events, the render thread wakes it up with glfwPostEmptyEvent when it stops
+            while (rendering && !glfwWindowShouldClose(window)) {
+                if (settings.eventStormSize > 0) {
+                    glfwWaitEventsTimeout(0.001); // keep the storms coming even without real events
+                    generateEventStorm();
+                } else {
+                    glfwWaitEvents();
+                }
+            }
+
+            rendering = false;
+            notifyVisibilityChanged(); // in case the render thread is suspended
+            renderThread.join();
+            if (!renderThreadError.empty()) {
+                throw std::runtime_error(renderThreadError);
+            }
+        } else {
+            while (rendering && !glfwWindowShouldClose(window)) {
+                waitWhileSuspended(); // before the pacer starts timing the frame work, like renderLoop()
+                framePacer.waitForNextFrame(); // sleep before polling, so the frame uses the latest input
+                glfwPollEvents();
+                generateEventStorm();
+                renderFrame();
+            }
+        }
+
+        // drawing is asynchronous, wait everything to finish before cleaning up
+        stopSubmitThread();
+        vkDeviceWaitIdle(device);
+    }
+
+    void stepSimulation(SimulationState& state, double dt) {
+        state.angle += state.angularVelocity * dt;
+    }
+
+    // runs as many fixed steps as the elapsed time asks for, then interpolates the state we draw
+    void updateSimulation() {
+        if (settings.simulationHz <= 0.0) {
+            return;
+        }
+
+        const double step = 1.0 / settings.simulationHz;
+        const int maxStepsPerFrame = 8; // if we fall behind more than this, slow down instead of never catching up
+
+        double now = glfwGetTime();
+        if (lastSimulationTime == 0.0 || lastFrameTime == 0.0) {
+            lastSimulationTime = now; // first frame or coming back from a suspension, don't simulate the pause
+        }
+        simulationAccumulator += now - lastSimulationTime;
+        lastSimulationTime = now;
+
+        int steps = 0;
+        while (simulationAccumulator >= step) {
+            if (steps == maxStepsPerFrame) {
+                simulationAccumulator = 0.0;
+                droppedSimulationTime++;
+                break;
+            }
+
+            double stepStart = glfwGetTime();
+            previousSimulationState = currentSimulationState;
+            stepSimulation(currentSimulationState, step);
+            simulationStepStats.add((glfwGetTime() - stepStart) * 1000.0);
+
+            simulationAccumulator -= step;
+            simulationSteps++;
+            steps++;
+        }
+
+        // keep the angle small so doubles don't lose precision after hours
+        const double twoPi = 6.283185307179586;
+        if (currentSimulationState.angle > twoPi) {
+            currentSimulationState.angle -= twoPi;
+            previousSimulationState.angle -= twoPi;
+        }
+
+        double alpha = simulationAccumulator / step; // how far we are between the previous and the current state
+        double angle = previousSimulationState.angle + (currentSimulationState.angle - previousSimulationState.angle) * alpha;
+        const double radius = 0.25;
+        renderState.offsetX = (float) (radius * std::cos(angle));
+        renderState.offsetY = (float) (radius * std::sin(angle));
+    }
+
+    // everything the renderer does each frame, on the main thread or on the render thread
+    void renderFrame() {
+        processEvents();
+        updateSimulation();
+        double frameCpuStart = glfwGetTime();
+        drawFrame();
+        frameCpuStats.add((glfwGetTime() - frameCpuStart) * 1000.0);
+        framePacer.frameDone();
+
+        if (settings.benchmarkFrames > 0 && frameCount >= settings.benchmarkFrames) {
+            rendering = false;
+        }
+    }
+
+    // render thread, owns the device queues until it returns. An exception would terminate the process here, so it
+    // is kept for the main thread to rethrow.
+    void renderLoop() {
+        try {
+            while (rendering) {
+                waitWhileSuspended();
+                if (!rendering) {
+                    break;
+                }
+                framePacer.waitForNextFrame();
+                renderFrame();
+            }
+        } catch (const std::exception& e) {
+            renderThreadError = e.what();
+            rendering = false;
+        }
+
+        glfwPostEmptyEvent(); // the main thread may be sleeping in glfwWaitEvents
+    }
+
+    // sorts sortBenchmarkPackets packets with random keys with the DrawQueue radix sort and with std::stable_sort, and prints the throughput
+    void benchmarkSort() {
+        const int iterations = 20;
+        // runs before glfwInit(), so glfwGetTime() isn't available
+        auto now = [] { return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count(); };
+        std::mt19937_64 random(42);
+        std::vector<uint64_t> keys(settings.sortBenchmarkPackets);
+        for (auto& key : keys) {
+            // realistic keys: a few passes and pipelines, more materials, any depth
+            key = makeSortKey((uint32_t) (random() % 2), (uint32_t) (random() % 16), (uint32_t) (random() % 64),
+                              (uint32_t) (random() % 1024), (uint32_t) random());
+        }
+
+        RunningStats radixTime;
+        RunningStats stdSortTime;
+        DrawQueue queue;
+        std::vector<DrawPacket> packets;
+        for (int i = 0; i < iterations; i++) {
+            double start = now();
+            queue.clear();
+            for (uint32_t packet = 0; packet < (uint32_t) keys.size(); packet++) {
+                queue.push(keys[packet], packet);
+            }
+            queue.sort();
+            radixTime.add((now() - start) * 1000.0);
+
+            start = now();
+            packets.clear();
+            for (uint32_t packet = 0; packet < (uint32_t) keys.size(); packet++) {
+                packets.push_back({keys[packet], packet});
+            }
+            std::stable_sort(packets.begin(), packets.end(), [](const DrawPacket& a, const DrawPacket& b) { return a.key < b.key; });
+            stdSortTime.add((now() - start) * 1000.0);
+        }
+
+        // both are stable, so they must agree on everything
+        for (size_t i = 0; i < packets.size(); i++) {
+            if (packets[i].drawIndex != queue.sorted()[i].drawIndex) {
+                throw std::runtime_error("radix sort and std::stable_sort disagree!");
+            }
+        }
+
+        std::cout << "sorting " << keys.size() << " draw packets, " << iterations << " times\n";
+        radixTime.print("radix sort");
+        std::cout << "\t\t" << (double) keys.size() / radixTime.mean() / 1000.0 << " million packets/s\n";
+        stdSortTime.print("std::stable_sort");
+        std::cout << "\t\t" << (double) keys.size() / stdSortTime.mean() / 1000.0 << " million packets/s\n";
+    }
+
+    // 0, 1, 2, 4... and finally recordThreads itself
+    uint32_t nextThreadCount(uint32_t threads) {
+        if (threads == 0) {
+            return 1;
+        }
+        if (threads < settings.recordThreads && threads * 2 > settings.recordThreads) {
+            return settings.recordThreads;
+        }
+        return threads * 2;
+    }
+
+    // records the whole draw list many times with 0 (inline) to recordThreads threads and prints the throughput.
+    // Nothing is submitted, it only measures the CPU side.
+    void benchmarkRecording() {
+        std::cout << "recording " << drawList.size() << " draws with the " << drawPathName(drawPath) << " draw path, "
+                  << settings.recordingBenchmarkIterations << " times per thread count\n";
+        queueDraws(0); // sorting isn't part of what's measured, it's the same for every thread count
+
+        double singleThreadTime = 0.0;
+        for (uint32_t threads = 0; threads <= settings.recordThreads; threads = nextThreadCount(threads)) {
+            RunningStats recordTime;
+            for (uint32_t i = 0; i < settings.recordingBenchmarkIterations; i++) {
+                double start = glfwGetTime();
+                vkResetCommandPool(device, frameCommandPools[0], 0);
+                recordCommandBuffer(frameCommandBuffers[0], 0, 0, threads);
+                recordTime.add((glfwGetTime() - start) * 1000.0);
+            }
+
+            if (threads == 1) {
+                singleThreadTime = recordTime.mean();
+            }
+            std::string name = threads == 0 ? "inline" : std::to_string(threads) + " thread(s)";
+            recordTime.print(name.c_str());
+            std::cout << "\t\t" << (double) drawList.size() / recordTime.mean() / 1000.0 << " million draws/s";
+            if (threads > 1 && singleThreadTime > 0.0) {
+                std::cout << ", " << singleThreadTime / recordTime.mean() << "x the single thread speed";
+            }
+            std::cout << '\n';
+        }
+    }
+
+    void printStats() {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        std::cout << "device: " << properties.deviceName << '\n';
+        std::cout << "frames rendered: " << frameCount << " with " << settings.maxFramesInFlight << " frame(s) in flight, "
+                  << (timelineSemaphoreEnabled ? "timeline semaphore" : "fences") << " for frame throttling\n";
+        frameTimeStats.print("frame time");
+        fenceWaitStats.print("cpu blocked on gpu");
+        std::cout << "\trendering suspended " << suspendCount << " time(s), " << suspendedTime << "s in total\n";
+        std::cout << "\trendering on " << (settings.renderThread ? "a render thread" : "the main thread") << '\n';
+        if (eventsOverflowed > 0) {
+            std::cout << "\t" << eventsOverflowed << " event(s) didn't fit in the event queue and were kept aside\n";
+        }
+        if (settings.eventStormSize > 0) {
+            std::cout << "\tsynthetic events: " << syntheticEventsGenerated << " generated, " << syntheticEventsProcessed
+                      << " processed, " << syntheticEventsDropped << " dropped\n";
+        }
+        acquireWaitStats.print("acquire wait");
+        {
+            std::lock_guard<std::mutex> lock(presentWaitMutex);
+            std::cout << "\tdisplay latency " << (presentWaitEnabled ? "measured with VK_KHR_present_wait" : "estimated from acquire times (upper bound)") << '\n';
+            printPercentiles("frame start to display", displayLatencies);
+        }
+        std::cout << "\tswap chain images: " << swapChainImages.size() << " of " << swapChainExtent.width << "x"
+                  << swapChainExtent.height << " (" << (settings.swapChainImages == 0 ? "auto" : "fixed") << ", about "
+                  << swapChainImages.size() * swapChainExtent.width * swapChainExtent.height * 4 / (1024 * 1024) << "MiB)\n";
+        if (settings.swapChainImages == 0) {
+            for (const auto& depthStats : depthTuner.stats) {
+                std::cout << "\tswap chain depth " << depthStats.first << ":\n";
+                depthStats.second.frameTime.print("\tframe time");
+                depthStats.second.acquireWait.print("\tacquire wait");
+            }
+        }
+        std::cout << "\tswap chain recreated " << swapChainRecreateCount << " time(s)\n";
+        std::cout << "\tpipelines built at startup in " << startupPipelineTime << "ms with a "
+                  << (pipelineCacheWarm ? "warm" : "cold") << " pipeline cache (" << pipelineCacheStatus << "), saved "
+                  << pipelineCacheSaves << " time(s)\n";
+        if (settings.asyncPipelines != AsyncPipelines::Off) {
+            std::cout << "\tpipelines compiled in the background by " << pipelineWorkers.size() << " thread(s), "
+                      << pipelineFallbackDraws << " draws used the fallback, " << pipelineSkippedDraws << " were skipped\n";
+            if (asyncPipelineStats.count > 0) {
+                asyncPipelineStats.print("background pipeline compile");
+            }
+        }
+        std::cout << "\tpipeline registry: " << pipelineRegistry.requested << " pipelines requested, "
+                  << pipelineRegistry.created << " built, " << pipelineRegistry.unique() << " unique alive";
+        if (pipelineRegistry.raced > 0) {
+            std::cout << ", " << pipelineRegistry.raced << " built twice at the same time";
+        }
+        std::cout << '\n';
+        if (settings.materialCount > 1 || settings.dynamicState) {
+            std::cout << "\t" << settings.materialCount << " material(s) need " << countMaterialPipelines(true)
+                      << " pipeline(s)";
+            if (dynamicRasterState || dynamicBlendState) {
+                std::cout << " with " << (dynamicRasterState ? "cull mode, front face, topology " : "")
+                          << (dynamicBlendState ? "blending " : "") << "as dynamic state, "
+                          << countMaterialPipelines(false) << " as baked permutations";
+            }
+            std::cout << '\n';
+
+            // the variants are specializations of one module, not separate SPIR-V to load and keep around
+            std::vector<ShaderVariant> variants;
+            for (uint32_t material = 0; material < settings.materialCount; material++) {
+                const ShaderVariant& variant = materialStates[material].fragmentVariant;
+                if (std::none_of(variants.begin(), variants.end(),
+                        [&](const ShaderVariant& other) { return memcmp(&variant, &other, sizeof(variant)) == 0; })) {
+                    variants.push_back(variant);
+                }
+            }
+            std::cout << "\t" << variants.size() << " fragment shader variant(s) specialized from "
+                      << pipelineShaderFiles[(size_t) PipelineShader::Fragment] << '\n';
+        }
+        if (pipelineReloadStats.count > 0) {
+            pipelineReloadStats.print("pipeline reload");
+        }
+        std::cout << "\tdeferred deletions: " << deferredDeletionCount << " queued, at most " << deletionQueuePeak
+                  << " waiting for the GPU at once\n";
+        if (swapChainRecreateCount > 0) {
+            swapChainRecreateStats.print("swap chain recreation");
+        }
+        if (framePacer.enabled()) {
+            framePacer.print();
+        }
+        if (settings.simulationHz > 0.0) {
+            double runTime = std::max(frameTimeStats.sum / 1000.0, 0.001);
+            std::cout << "simulation at " << settings.simulationHz << "Hz: " << simulationSteps << " steps ("
+                      << simulationSteps / runTime << "/s) for " << frameCount << " frames (" << frameCount / runTime
+                      << "/s), fell behind " << droppedSimulationTime << " time(s)\n";
+            simulationStepStats.print("cpu per simulation step");
+            frameCpuStats.print("cpu per rendered frame");
+        }
+        if (settings.recordMode == RecordMode::Transient) {
+            std::cout << "command buffers recorded every frame from transient per frame pools, " << drawList.size() << " draws";
+            if (settings.recordThreads > 0) {
+                std::cout << " in secondary command buffers recorded by " << settings.recordThreads << " thread(s)";
+            }
+            std::cout << '\n';
+            recordStats.print("pool reset and recording per frame");
+        } else if (settings.recordMode == RecordMode::CommandList) {
+            std::cout << "draws recorded in command lists by " << (settings.recordThreads > 0 ? settings.recordThreads : 1)
+                      << " thread(s), then translated to command buffers, " << drawList.size() << " draws\n";
+            recordStats.print("recording and translating per frame");
+            commandListStats.print("recording the command lists");
+            size_t commands = 0;
+            for (const auto& list : commandLists) {
+                commands += list.size();
+            }
+            std::cout << "\t" << commands << " commands in the last frame, arena of " << frameArenas[0]->capacity() / 1024
+                      << "KiB per frame slot\n";
+        } else if (settings.recordMode == RecordMode::Cached) {
+            std::cout << "command buffers of " << settings.cellCount << " cells cached, " << drawList.size() << " draws\n";
+            recordStats.print("recording per frame, cached cells included");
+            uint64_t lookups = bucketCacheHits + bucketCacheMisses;
+            if (lookups > 0) {
+                std::cout << "\tbucket cache hit rate " << 100.0 * (double) bucketCacheHits / (double) lookups << "% ("
+                          << bucketCacheHits << " hits, " << bucketCacheMisses << " re-recorded)\n";
+            }
+        } else {
+            std::cout << "command buffers pre-recorded per swap chain image\n";
+            preRecordStats.print("recording all images");
+            if (recordStats.count > 0) {
+                recordStats.print("re-recording an animated image");
+            }
+        }
+        if (drawSortStats.count > 0) {
+            std::cout << "draw queue of " << drawQueue.size() << " packets with " << settings.materialCount << " material(s)\n";
+            drawSortStats.print("filling and sorting the queue");
+        }
+        if (settings.instanceCount > 0 && frameTimeStats.mean() > 0.0) {
+            std::cout << "instancing: " << settings.instanceCount << " instances in " << drawList.size() << " draw(s), "
+                      << (double) settings.instanceCount / frameTimeStats.mean() / 1000.0 << " million instances/s\n";
+        }
+        if (stateIssuedStats.count > 0) {
+            std::cout << "state filter " << (settings.stateFilter ? "on" : "off (counting only)")
+                      << ", binds and dynamic state per recorded frame:\n";
+            stateIssuedStats.print("issued", "");
+            stateFilteredStats.print(settings.stateFilter ? "filtered as redundant" : "redundant, issued anyway", "");
+        }
+        if (recordedDrawCalls > 0) {
+            std::cout << drawPathName(drawPath) << " draw path: " << recordedDraws << " draws recorded with " << recordedDrawCalls
+                      << " draw calls, " << (double) recordedDraws / (double) recordedDrawCalls << " draws per call\n";
+        }
+        if (submitCallStats.count > 0) {
+            std::cout << "frames submitted and presented " << (settings.submitThread ? "by a submission thread" : "inline") << '\n';
+            if (settings.submitThread) {
+                submitQueueDepthStats.print("queue depth", " frames");
+            }
+            submitCallStats.print("vkQueueSubmit");
+            presentCallStats.print("vkQueuePresentKHR");
+            framesPerSubmitStats.print("frames per vkQueueSubmit", "");
+        }
+        for (int policy = 0; policy < (int) PresentPolicy::Count; policy++) {
+            const auto& policyStats = presentPolicyStats[policy];
+            if (policyStats.acquireToPresent.count == 0) {
+                continue; // never used
+            }
+            std::cout << "present policy " << presentPolicyName((PresentPolicy) policy) << " (";
+            for (auto presentMode : policyStats.presentModesUsed) {
+                std::cout << ' ' << presentModeName(presentMode);
+            }
+            std::cout << " )\n";
+            policyStats.frameTime.print("frame time");
+            policyStats.acquireToPresent.print("acquire to present");
+        }
+        // the time the CPU was not blocked is time it worked in parallel with the GPU
+        if (frameTimeStats.mean() > 0.0) {
+            double overlap = 1.0 - std::min(1.0, fenceWaitStats.mean() / frameTimeStats.mean());
+            std::cout << "\tcpu/gpu overlap: " << overlap * 100.0 << "% of the frame time\n";
         }
     }
 
     void cleanup() {
-        vkDestroySemaphore(device, renderFinishedSemaphore, nullptr);
-        vkDestroySemaphore(device, imageAvailableSemaphore, nullptr);
+        stopHelperThreads();
+        for (int i = 0; i < settings.maxFramesInFlight; i++) {
+            vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+            vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+        }
+        for (auto fence : inFlightFences) {
+            vkDestroyFence(device, fence, nullptr);
+        }
+        if (frameTimeline != VK_NULL_HANDLE) {
+            vkDestroySemaphore(device, frameTimeline, nullptr);
+        }
+        releaseDeferredDeletions(true); // the device is idle, everything can go
+        for (auto pool : frameCommandPools) {
+            vkDestroyCommandPool(device, pool, nullptr); // frees its command buffer too
+        }
+        for (size_t i = 0; i < indirectArgBuffers.size(); i++) {
+            vkDestroyBuffer(device, indirectArgBuffers[i], nullptr);
+            vkFreeMemory(device, indirectArgMemories[i], nullptr); // unmaps it too
+            vkDestroyBuffer(device, indirectCountBuffers[i], nullptr);
+            vkFreeMemory(device, indirectCountMemories[i], nullptr);
+        }
+        if (instanceBuffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(device, instanceBuffer, nullptr);
+            vkFreeMemory(device, instanceBufferMemory, nullptr);
+        }
+        if (indexBuffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(device, indexBuffer, nullptr);
+            vkFreeMemory(device, indexBufferMemory, nullptr);
+        }
+        for (auto pool : bucketCachePools) {
+            vkDestroyCommandPool(device, pool, nullptr);
+        }
+        recordWorkers.stop();
+        for (auto& slotPools : recordPools) {
+            for (auto pool : slotPools) {
+                vkDestroyCommandPool(device, pool, nullptr);
+            }
+        }
         vkDestroyCommandPool(device, commandPool, nullptr);
         for (auto framebuffer : swapChainFramebuffers) {
             vkDestroyFramebuffer(device, framebuffer, nullptr);
         }
-        vkDestroyPipeline(device, graphicsPipeline, nullptr);
+        for (auto pipeline : graphicsPipelines) {
+            pipelineRegistry.release(device, pipeline); // some may not exist, VK_NULL_HANDLE is ignored
+        }
         vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+        savePipelineCache();
+        vkDestroyPipelineCache(device, pipelineCache, nullptr);
         vkDestroyRenderPass(device, renderPass, nullptr);
         for (auto imageView : swapChainImageViews) {
             vkDestroyImageView(device, imageView, nullptr);
@@ -986,10 +4775,11 @@ private:
     }
 };
 
-int main() {
+int main(int argc, char* argv[]) {
     HelloTriangleApplication app;
 
     try {
+        app.parseArguments(argc, argv);
         app.run();
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
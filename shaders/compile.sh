@@ -9,4 +9,5 @@ if ! [ -x "$path_to_glslc" ] ; then
 fi
 
 glslc "${HERE}/shader.vert" -o "${HERE}/vert.spv"
-glslc "${HERE}/shader.frag" -o "${HERE}/frag.spv"
\ No newline at end of file
+glslc "${HERE}/shader.frag" -o "${HERE}/frag.spv"
+glslc "${HERE}/instanced.vert" -o "${HERE}/instanced.spv"
\ No newline at end of file
@@ -1,10 +1,28 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+// The shader features are specialization constants, set by the pipeline (see ShaderVariant in main.cpp). Every
+// variant is built from this one module, and the driver drops the code a variant doesn't use.
+layout(constant_id = 0) const int LIGHTING_MODEL = 0; // 0 the vertex color, 1 the vertex color in bands
+layout(constant_id = 1) const bool ALPHA_TEST = false; // discard the fragments with an alpha under ALPHA_CUTOFF
+layout(constant_id = 2) const float ALPHA_CUTOFF = 0.5;
+layout(constant_id = 3) const float BANDS = 4.0; // steps per color channel with LIGHTING_MODEL 1
+
 layout(location = 0) in vec3 fragColor;
 
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
-}
\ No newline at end of file
+    vec3 color = fragColor;
+    if (LIGHTING_MODEL == 1) {
+        color = floor(color * BANDS) * (1.0 / BANDS);
+    }
+
+    // diagonal stripes in screen space, the color can't be used: it comes per vertex or per instance (--instances)
+    float alpha = fract((gl_FragCoord.x + gl_FragCoord.y) * (1.0 / 16.0));
+    if (ALPHA_TEST && alpha < ALPHA_CUTOFF) {
+        discard;
+    }
+
+    outColor = vec4(color, 1.0);
+}
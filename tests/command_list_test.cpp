@@ -0,0 +1,182 @@
+// Checks the recording side of the renderer without a Vulkan device: command lists, their validation, the frame
+// arena they live in and the state filter. Returns non zero if anything fails, run by ctest.
+#include "../command_list.h"
+#include <iostream>
+
+static int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+static void check(bool passed, const char* condition, int line) {
+    if (!passed) {
+        std::cerr << "line " << line << ": CHECK(" << condition << ") failed" << std::endl;
+        failures++;
+    }
+}
+
+// stands in for CommandBufferRecorder, remembers what reached it
+struct MockRecorder {
+    std::vector<CommandType> calls;
+
+    void bindPipeline(uint32_t) { calls.push_back(CommandType::BindPipeline); }
+    void setViewport(float, float, float, float) { calls.push_back(CommandType::SetViewport); }
+    void setScissor(int32_t, int32_t, uint32_t, uint32_t) { calls.push_back(CommandType::SetScissor); }
+    void bindIndexBuffer(BufferId) { calls.push_back(CommandType::BindIndexBuffer); }
+    void bindVertexBuffer(BufferId) { calls.push_back(CommandType::BindVertexBuffer); }
+    void setRasterState(const Command::RasterState&) { calls.push_back(CommandType::SetRasterState); }
+    void setBlendState(const Command::BlendState&) { calls.push_back(CommandType::SetBlendState); }
+    void draw(uint32_t, uint32_t, uint32_t, uint32_t) { calls.push_back(CommandType::Draw); }
+    void drawIndexedIndirect(BufferId, uint64_t, uint32_t, uint32_t) { calls.push_back(CommandType::DrawIndexedIndirect); }
+    void drawIndexedIndirectCount(BufferId, uint64_t, BufferId, uint64_t, uint32_t, uint32_t) {
+        calls.push_back(CommandType::DrawIndexedIndirectCount);
+    }
+    void dispatch(uint32_t, uint32_t, uint32_t) { calls.push_back(CommandType::Dispatch); }
+    void barrier(uint32_t, uint32_t, uint32_t, uint32_t) { calls.push_back(CommandType::Barrier); }
+};
+
+// the commands every draw needs before it
+static void recordSetup(CommandList& list) {
+    list.bindPipeline(0);
+    list.setViewport(0.0f, 0.0f, 800.0f, 600.0f);
+    list.setScissor(0, 0, 800, 600);
+}
+
+static void testRecordingOrder() {
+    FrameArena arena(1 << 20);
+    CommandList list;
+    list.begin(arena);
+    recordSetup(list);
+    const uint32_t drawCount = 1000; // several chunks
+    for (uint32_t i = 0; i < drawCount; i++) {
+        list.draw(3, 1, 0, i);
+    }
+
+    CHECK(list.size() == drawCount + 3);
+    CHECK(!list.overflowed());
+    CHECK(list.validate().empty());
+
+    size_t index = 0;
+    bool inOrder = true;
+    list.forEach([&](const Command& command) {
+        if (index == 0) {
+            inOrder = inOrder && command.type == CommandType::BindPipeline;
+        } else if (index >= 3) {
+            inOrder = inOrder && command.type == CommandType::Draw && command.draw.firstInstance == index - 3;
+        }
+        index++;
+    });
+    CHECK(index == list.size());
+    CHECK(inOrder);
+
+    // begin starts over, the old commands are not visited anymore
+    list.begin(arena);
+    CHECK(list.size() == 0);
+    list.forEach([&](const Command&) { CHECK(false); });
+}
+
+static void testValidate() {
+    FrameArena arena(1 << 20);
+    CommandList list;
+
+    list.begin(arena);
+    list.bindPipeline(0);
+    list.setViewport(0.0f, 0.0f, 800.0f, 600.0f);
+    list.draw(3, 1, 0, 0); // no scissor
+    CHECK(list.validate() == "command 2: draw without a pipeline, viewport or scissor");
+
+    list.begin(arena);
+    recordSetup(list);
+    list.drawIndexedIndirect(BufferId::IndirectArgs, 0, 1, 20);
+    CHECK(list.validate() == "command 3: indexed draw without an index buffer");
+
+    list.begin(arena);
+    recordSetup(list);
+    list.bindIndexBuffer(BufferId::Index);
+    list.drawIndexedIndirect(BufferId::IndirectArgs, 0, 1, 20);
+    list.drawIndexedIndirectCount(BufferId::IndirectArgs, 0, BufferId::IndirectCount, 0, 1, 20);
+    CHECK(list.validate().empty());
+
+    list.begin(arena);
+    list.barrier(1, 2, 3, 4);
+    list.dispatch(1, 1, 1);
+    CHECK(list.validate() == "command 1: dispatch without a pipeline");
+}
+
+static void testArenaOverflow() {
+    FrameArena arena(1024); // smaller than a chunk of commands
+    void* first = arena.allocate(1);
+    void* second = arena.allocate(1);
+    CHECK(first != nullptr && second != nullptr);
+    CHECK(reinterpret_cast<uintptr_t>(second) - reinterpret_cast<uintptr_t>(first) == 16);
+
+    CommandList list;
+    list.begin(arena);
+    recordSetup(list);
+    list.draw(3, 1, 0, 0);
+    CHECK(list.overflowed());
+    CHECK(arena.overflowed());
+    CHECK(list.size() == 0);
+    CHECK(list.validate() == "the frame arena ran out of memory");
+    CHECK(arena.bytesUsed() <= arena.capacity());
+
+    // the next reset grows the arena to what the frame asked for, then the same recording fits
+    size_t oldCapacity = arena.capacity();
+    arena.reset();
+    CHECK(arena.capacity() > oldCapacity);
+    CHECK(!arena.overflowed());
+    CHECK(arena.bytesUsed() == 0);
+
+    list.begin(arena);
+    recordSetup(list);
+    list.draw(3, 1, 0, 0);
+    CHECK(!list.overflowed());
+    CHECK(list.size() == 4);
+    CHECK(list.validate().empty());
+}
+
+static void testStateFilter() {
+    Command::RasterState raster{0, 0, 3};
+
+    MockRecorder filteredOut;
+    StateFilter<MockRecorder> filter(filteredOut, true);
+    MockRecorder countedOut;
+    StateFilter<MockRecorder> counter(countedOut, false);
+    for (int i = 0; i < 2; i++) {
+        for (auto* recorder : {&filter, &counter}) {
+            recorder->bindPipeline(1);
+            recorder->setViewport(0.0f, 0.0f, 800.0f, 600.0f);
+            recorder->setScissor(0, 0, 800, 600);
+            recorder->bindIndexBuffer(BufferId::Index);
+            recorder->setRasterState(raster);
+            recorder->draw(3, 1, 0, 0);
+        }
+    }
+    filter.bindPipeline(2); // a different pipeline always goes through
+    filter.barrier(0, 0, 0, 0);
+
+    // the second round only repeats state, only its draw reaches the recorder
+    CHECK(filter.issued == 6);
+    CHECK(filter.filtered == 5);
+    CHECK(filteredOut.calls.size() == 12 - 5 + 2);
+    CHECK(filteredOut.calls[5] == CommandType::Draw && filteredOut.calls[6] == CommandType::Draw);
+    CHECK(filteredOut.calls[7] == CommandType::BindPipeline);
+
+    // disabled it forwards everything, and still counts what it would have dropped
+    CHECK(counter.issued == 10);
+    CHECK(counter.filtered == 5);
+    CHECK(countedOut.calls.size() == 12);
+}
+
+int main() {
+    testRecordingOrder();
+    testValidate();
+    testArenaOverflow();
+    testStateFilter();
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}